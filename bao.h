@@ -5,11 +5,26 @@
 #ifndef BAOLIB_H_
 #define BAOLIB_H_
 
+/*
+ * The log drain timer and the thread support use POSIX.1-2008 interfaces
+ * that strict ISO C modes (-std=c11) hide on Linux, so ask for them here.
+ * This only takes effect if bao.h is included before any system header;
+ * otherwise define _POSIX_C_SOURCE (or _DEFAULT_SOURCE) yourself.
+ */
+#if defined(__STRICT_ANSI__) && defined(__linux__)                      \
+        && !defined(_POSIX_C_SOURCE) && !defined(_XOPEN_SOURCE)         \
+        && !defined(_GNU_SOURCE) && !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif /* __STRICT_ANSI__ && __linux__ */
+
 #include <assert.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
 
 #ifndef BAOLIBDEF
 #ifdef BAOLIBSTATIC
@@ -23,10 +38,19 @@
 
 #if !defined(BAO_LOG_MESSAGE) && !defined(BAO_POP_MESSAGE)
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <time.h>
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#define BAO_LOG_DRAIN
+#endif /* __unix__ || __APPLE__ */
 #define BAO_LOG
 #define BAO_LOG_STACK_CAPACITY (20)
 #define BAO_LOG_MESSAGE_CAPACITY (256)
+#define BAO_LOG_MAX_ARGS (16)
+#define BAO_LOG_STRING_CAPACITY (128)
 #define BAO_LOG_MESSAGE(fmt, ...)                                       \
         bao_log_message("Error in file '%s' at %s on line %d: " fmt,    \
                         __FILE__, __func__, __LINE__ __VA_OPT__(,) __VA_ARGS__)
@@ -44,9 +68,58 @@
 #define BAO_FREE(x) ((void) (free(x), x = NULL))
 #endif
 
+#ifndef BAO_NO_THREADS
+#include <pthread.h>
+#include <stdatomic.h>
+#define BAO_THREADS
+#endif /* BAO_NO_THREADS */
+
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(BAO_NO_MMAP)
+#include <sys/mman.h>
+#include <unistd.h>
+#if defined(MAP_ANONYMOUS)
+#define BAO_MMAP
+/* MREMAP_MAYMOVE needs _GNU_SOURCE on glibc; see BAO_ARRAY_MMAP_THRESHOLD. */
+#if defined(MREMAP_MAYMOVE)
+#define BAO_MREMAP
+#endif /* MREMAP_MAYMOVE */
+#endif /* MAP_ANONYMOUS */
+#endif /* (__unix__ || __APPLE__) && !BAO_NO_MMAP */
+
+#if defined(__SSE2__) && !defined(BAO_NO_SIMD)
+#include <emmintrin.h>
+#define BAO_SSE2
+#if (defined(__GNUC__) || defined(__clang__))                           \
+        && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define BAO_AVX2_DISPATCH
+#endif /* (__GNUC__ || __clang__) && (__x86_64__ || __i386__) */
+#endif
+
 #define BAO_MAX(a, b) (((a) > (b)) ? (a) : (b))
 #define BAO_MIN(a, b) (((a) > (b)) ? (b) : (a))
 
+#if defined(__GNUC__) || defined(__clang__)
+#define BAO_PREFETCH(p) __builtin_prefetch(p)
+#else /* !defined(__GNUC__) && !defined(__clang__) */
+#define BAO_PREFETCH(p) ((void) (p))
+#endif /* __GNUC__ || __clang__ */
+
+/*
+ * Allocator interface. Containers created with one of the *2 constructors
+ * take all their memory through it instead of BAO_MALLOC and friends; a
+ * NULL allocator keeps the BAO_MALLOC behaviour. The sizes passed to
+ * realloc and free are the ones the block was allocated with.
+ */
+struct bao_allocator_t {
+        void *(*alloc)(void *ctx, size_t size);
+        void *(*realloc)(void *ctx, void *p, size_t old_size, size_t new_size);
+        void (*free)(void *ctx, void *p, size_t size);
+        void *ctx;
+};
+
+typedef struct bao_allocator_t *bao_allocator_t;
+
 struct bao_arena_chunk_t {
         struct bao_arena_chunk_t *prev;
         char *avail;
@@ -55,14 +128,69 @@ struct bao_arena_chunk_t {
 
 typedef struct bao_arena_chunk_t *bao_arena_chunk_t;
 
+/*
+ * Requests of at least large_size bytes get a block of their own, which is
+ * given back by the next bao_arena_free.
+ */
+struct bao_arena_large_t {
+        struct bao_arena_large_t *next;
+        size_t size;
+};
+
+/*
+ * Chunk policy of an arena. New chunks start at chunk_size bytes and
+ * double up to max_chunk_size; bao_arena_free keeps at most retain_size
+ * bytes of chunks for reuse. Zero fields take the BAO_ARENA_* defaults.
+ *
+ * A non-zero reserve_size makes the arena map that much address space up
+ * front, aligned to BAO_ARENA_HUGE_PAGE and marked for transparent huge
+ * pages where the kernel supports it. Pages are only committed when first
+ * touched, and bao_arena_free gives them back with MADV_DONTNEED instead
+ * of walking and freeing chunks. Once the reservation is used up the arena
+ * falls back to ordinary chunks.
+ */
+struct bao_arena_policy_t {
+        size_t chunk_size;
+        size_t max_chunk_size;
+        size_t large_size;
+        size_t retain_size;
+        size_t reserve_size;
+};
+
+#define BAO_ARENA_CHUNK_SIZE (10*1024)
+#define BAO_ARENA_MAX_CHUNK_SIZE (1024*1024)
+#define BAO_ARENA_LARGE_SIZE (256*1024)
+#define BAO_ARENA_RETAIN_SIZE (4*1024*1024)
+#define BAO_ARENA_HUGE_PAGE (2*1024*1024)
+
 struct bao_arena_t {
         bao_arena_chunk_t bao_arena_freechunks;
         size_t bao_arena_nfree;
+        size_t bao_arena_freebytes;
         bao_arena_chunk_t first;
+        struct bao_arena_large_t *large;
+        struct bao_arena_policy_t policy;
+        size_t next_chunk_size;
+        bao_allocator_t allocator;
+        struct bao_allocator_t vtable;
+        struct bao_chunkpool_t *chunkpool;
+        bao_arena_chunk_t region;
+        size_t region_size;
 };
 
 typedef struct bao_arena_t *bao_arena_t;
 
+/*
+ * Savepoint of an arena, taken by bao_arena_mark. Rewinding to it gives
+ * back everything allocated since, as long as the arena has not been freed
+ * or rewound past the mark in between.
+ */
+struct bao_arena_mark_t {
+        bao_arena_chunk_t chunk;
+        char *avail;
+        struct bao_arena_large_t *large;
+};
+
 union bao_align_t {
         int i;
         long l;
@@ -75,15 +203,183 @@ union bao_align_t {
 };
 
 union bao_header_t {
-        struct bao_arena_t b;
+        struct bao_arena_chunk_t b;
+        struct bao_arena_large_t l;
+        union bao_align_t a;
+};
+
+#ifdef BAO_THREADS
+/*
+ * Chunk pool shared by thread-local arenas. Each thread gets its own
+ * bao_arena_t from bao_chunkpool_arena, which allocates without locking;
+ * the chunks it frees go back to the pool, which keeps at most
+ * policy.retain_size bytes of them for any thread to reuse.
+ */
+struct bao_chunkpool_t {
+        pthread_mutex_t lock;
+        pthread_key_t key;
+        bao_arena_chunk_t chunks;
+        size_t bytes;
+        struct bao_arena_policy_t policy;
+        bao_allocator_t allocator;
+};
+
+typedef struct bao_chunkpool_t *bao_chunkpool_t;
+
+/*
+ * Arena that any number of threads can allocate from at once. The bump
+ * pointer of the current chunk is advanced with an atomic fetch-add; only
+ * installing a new chunk or a large block takes the lock. bao_carena_free
+ * and bao_carena_release must not race with allocations.
+ */
+struct bao_carena_chunk_t {
+        struct bao_carena_chunk_t *prev;
+        atomic_size_t used;
+        size_t size;
+};
+
+union bao_carena_header_t {
+        struct bao_carena_chunk_t c;
         union bao_align_t a;
 };
 
+struct bao_carena_t {
+        _Atomic(struct bao_carena_chunk_t *) current;
+        pthread_mutex_t lock;
+        struct bao_carena_chunk_t *freechunks;
+        size_t freebytes;
+        struct bao_arena_large_t *large;
+        struct bao_arena_policy_t policy;
+        size_t next_chunk_size;
+        bao_allocator_t allocator;
+};
+
+typedef struct bao_carena_t *bao_carena_t;
+
+/*
+ * Work-stealing thread pool. Every worker owns a Chase-Lev deque of
+ * BAO_DEQUE_SIZE tasks: it pushes and takes at the bottom while idle
+ * workers steal from the top. Threads outside the pool hand their tasks
+ * in through a locked injection queue. Workers that find nothing to do
+ * sleep until work is queued.
+ */
+#define BAO_DEQUE_SIZE (4096)
+
+struct bao_task_t {
+        void (*run)(struct bao_task_t *task);
+        void (*fn)(void *);
+        void *arg;
+        size_t lo;
+        size_t hi;
+        _Atomic size_t *pending;
+        struct bao_task_t *next;
+};
+
+struct bao_deque_t {
+        _Atomic long top;
+        _Atomic long bottom;
+        _Atomic(struct bao_task_t *) tasks[BAO_DEQUE_SIZE];
+};
+
+struct bao_worker_t {
+        pthread_t thread;
+        struct bao_threadpool_t *pool;
+        size_t index;
+        uint32_t seed;
+        struct bao_deque_t deque;
+};
+
+struct bao_threadpool_t {
+        size_t nworkers;
+        struct bao_worker_t *workers;
+        pthread_mutex_t lock;
+        pthread_cond_t work;
+        pthread_cond_t done;
+        _Atomic int sleepers;
+        _Atomic int stop;
+        _Atomic size_t queued;
+        _Atomic size_t pending;
+        pthread_mutex_t inject_lock;
+        _Atomic size_t injected;
+        struct bao_task_t *inject_head;
+        struct bao_task_t *inject_tail;
+};
+
+typedef struct bao_threadpool_t *bao_threadpool_t;
+#endif /* BAO_THREADS */
+
+/*
+ * Fixed-size node pool. Nodes are carved out of chunks of BAO_POOL_CHUNK
+ * nodes and recycled through a free list; the chunks come from an arena
+ * when one is given and from BAO_MALLOC otherwise.
+ */
+#define BAO_POOL_CHUNK (256)
+
+struct bao_pool_t {
+        size_t memb_size;
+        size_t count;
+        bao_arena_t arena;
+        void *chunks;
+        void *freelist;
+        char *avail;
+        char *limit;
+};
+
+typedef struct bao_pool_t *bao_pool_t;
+
+/*
+ * Array flags. BAO_ARRAY_NO_ZERO arrays never zero their storage: new
+ * capacity and elements added by bao_array_resize are left uninitialized.
+ */
+#define BAO_ARRAY_NO_ZERO (1u << 0)
+
+/*
+ * Set by the array itself once its storage lives in its own mapping. When
+ * mremap is available (Linux with _GNU_SOURCE), arrays on the default
+ * allocator move to a mapping once they reach BAO_ARRAY_MMAP_THRESHOLD
+ * bytes, and from then on grow by remapping pages instead of copying.
+ */
+#define BAO_ARRAY_MAPPED (1u << 1)
+
+/*
+ * Set while the array's data is storage it does not own: the inline
+ * elements of bao_array_create_small or the buffer given to
+ * bao_array_init. The first growth past it moves the data to the heap.
+ */
+#define BAO_ARRAY_BORROWED (1u << 2)
+
+/*
+ * Key types for bao_array_radix_sort. The key is a fixed-width value at a
+ * byte offset inside each element.
+ */
+#define BAO_ARRAY_KEY_U32 (0)
+#define BAO_ARRAY_KEY_I32 (1)
+#define BAO_ARRAY_KEY_F32 (2)
+#define BAO_ARRAY_KEY_U64 (3)
+#define BAO_ARRAY_KEY_I64 (4)
+#define BAO_ARRAY_KEY_F64 (5)
+
+#define BAO_ARRAY_NOT_FOUND (SIZE_MAX)
+
+/*
+ * Only used when BAO_MREMAP is defined. glibc exposes mremap and
+ * MREMAP_MAYMOVE only under _GNU_SOURCE, which neither -std=gnu11 nor
+ * bao.h sets, so a Linux build must define _GNU_SOURCE before including
+ * bao.h (or any system header) to use it; otherwise large arrays grow
+ * with realloc like small ones.
+ */
+#ifndef BAO_ARRAY_MMAP_THRESHOLD
+#define BAO_ARRAY_MMAP_THRESHOLD (64*1024*1024)
+#endif /* BAO_ARRAY_MMAP_THRESHOLD */
+
 struct bao_array_t {
         size_t size;
         size_t memb_size;
         size_t capacity;
         void *data;
+        bao_allocator_t allocator;
+        unsigned flags;
+        size_t inline_capacity;
 };
 
 typedef struct bao_array_t *bao_array_t;
@@ -95,6 +391,19 @@ struct bao_list_t {
 
 typedef struct bao_list_t *bao_list_t;
 
+/*
+ * Seeded hash functions, and hash and compare callback pairs for common
+ * key types. The callbacks hash with BAO_HASH_SEED.
+ */
+#ifndef BAO_HASH_SEED
+#define BAO_HASH_SEED (0)
+#endif /* BAO_HASH_SEED */
+
+struct bao_lstring_t {
+        size_t length;
+        char data[];
+};
+
 struct bao_map_t {
         size_t size;
         size_t length;
@@ -102,13 +411,172 @@ struct bao_map_t {
         size_t (*hash)(const void *);
         struct bao_mapping_t {
                 struct bao_mapping_t *next;
+                size_t hash;
                 void *key;
                 void *value;
         } **buckets;
+        struct bao_mapping_t **old_buckets;
+        size_t old_size;
+        size_t rehash;
+        size_t min_size;
+        bao_pool_t pool;
+        bao_allocator_t allocator;
 };
 
 typedef struct bao_map_t *bao_map_t;
 
+/*
+ * Cursor over a map's buckets and chains. While it is in use the map may
+ * only be read (bao_map_find and the like); any other call that modifies it,
+ * including inserting or removing, invalidates the cursor. Entries can be
+ * dropped during iteration only through bao_map_iter_remove.
+ */
+struct bao_map_iter_t {
+        bao_map_t map;
+        size_t bucket;
+        struct bao_mapping_t **link;
+        struct bao_mapping_t **prev;
+};
+
+/*
+ * Open addressing map. Slots are stored flat and every slot has a control
+ * byte holding either 7 bits of its hash or an empty/deleted marker, so a
+ * probe scans BAO_FLATMAP_GROUP control bytes at once before touching any
+ * key.
+ */
+#define BAO_FLATMAP_GROUP (16)
+
+struct bao_flatmap_t {
+        size_t capacity;
+        size_t length;
+        size_t growth_left;
+        int (*compare)(const void *, const void *);
+        size_t (*hash)(const void *);
+        signed char *ctrl;
+        struct bao_flatslot_t {
+                void *key;
+                void *value;
+        } *slots;
+};
+
+typedef struct bao_flatmap_t *bao_flatmap_t;
+
+/*
+ * Immutable map built by bao_map_freeze. Keys are spread over buckets of
+ * about BAO_FROZENMAP_LOAD keys, and every bucket stores a displacement
+ * that sends each of its keys to its own slot, so the slots are exactly as
+ * many as the keys and a lookup reads one of them. A displacement with
+ * BAO_FROZENMAP_DIRECT set is the slot of a single-key bucket itself.
+ */
+#define BAO_FROZENMAP_LOAD (3)
+#define BAO_FROZENMAP_DIRECT (UINT32_C(1) << 31)
+#define BAO_FROZENMAP_ATTEMPTS (65536)
+#define BAO_FROZENMAP_RETRIES (4)
+
+struct bao_frozenmap_t {
+        size_t length;
+        size_t nbuckets;
+        int (*compare)(const void *, const void *);
+        size_t (*hash)(const void *);
+        uint32_t *disp;
+        struct bao_frozenslot_t {
+                size_t hash;
+                void *key;
+                void *value;
+        } *slots;
+};
+
+typedef struct bao_frozenmap_t *bao_frozenmap_t;
+
+/*
+ * Flat file format for arrays and frozen maps. A file starts with a
+ * bao_file_header_t and every section begins at a multiple of
+ * BAO_FILE_ALIGN bytes; keys and values inside the blob section are only
+ * aligned to BAO_FILE_ITEM_ALIGN. Sections refer to each other by offsets
+ * from the start of the file, never by pointers, so a file can be mapped
+ * read-only at any address and used in place. Values are stored in the
+ * byte order of the writer and hashes with the width of its size_t, and
+ * the loader checks both against its own.
+ */
+#define BAO_FILE_MAGIC "BAOFILE"
+#define BAO_FILE_VERSION (1)
+#define BAO_FILE_ALIGN (64)
+#define BAO_FILE_ITEM_ALIGN (8)
+#define BAO_FILE_BYTE_ORDER UINT32_C(0x01020304)
+#define BAO_FILE_ARRAY (1)
+#define BAO_FILE_FROZENMAP (2)
+
+struct bao_file_header_t {
+        char magic[8];
+        uint32_t version;
+        uint32_t byte_order;
+        uint32_t kind;
+        uint32_t word_size;
+        uint64_t size;
+        uint64_t count;
+        uint64_t memb_size;
+        uint64_t nbuckets;
+        uint64_t data_offset;
+        uint64_t slots_offset;
+        uint64_t blob_offset;
+        uint64_t blob_size;
+};
+
+/*
+ * Frozen map slot on disk. Key and value bytes live in the blob section,
+ * at offsets from the start of the file.
+ */
+struct bao_fileslot_t {
+        uint64_t hash;
+        uint64_t key_offset;
+        uint64_t key_size;
+        uint64_t value_offset;
+        uint64_t value_size;
+};
+
+/*
+ * A loaded file: mapped read-only where mmap is available and read into
+ * memory otherwise.
+ */
+struct bao_mapped_t {
+        void *base;
+        size_t size;
+        int mapped;
+        const struct bao_file_header_t *header;
+};
+
+typedef struct bao_mapped_t *bao_mapped_t;
+
+#ifdef BAO_THREADS
+/*
+ * Concurrent map made of independent bao_map_t segments, each behind its
+ * own reader-writer lock and picked by the high bits of the mixed key
+ * hash. Lookups only take a segment's read lock; writers take its write
+ * lock and resize that segment incrementally without blocking the others.
+ * Only inserts and removes advance a segment's resize. A segment that
+ * stops receiving writes mid-resize stays that way, and each lookup on it
+ * pays one extra modulo to choose between the old and new bucket arrays,
+ * never a second probe. Building with -std=c11 needs POSIX.1-2008 for
+ * pthread_rwlock_t, which bao.h requests when it is included first.
+ */
+#define BAO_CMAP_SEGMENTS (64)
+
+struct bao_cmap_segment_t {
+        pthread_rwlock_t lock;
+        bao_map_t map;
+        char pad[64];
+};
+
+struct bao_cmap_t {
+        size_t nsegments;
+        unsigned shift;
+        size_t (*hash)(const void *);
+        struct bao_cmap_segment_t *segments;
+};
+
+typedef struct bao_cmap_t *bao_cmap_t;
+#endif /* BAO_THREADS */
+
 struct bao_set_t {
         size_t size;
         size_t length;
@@ -116,12 +584,32 @@ struct bao_set_t {
         size_t (*hash)(const void *);
         struct bao_member_t {
                 struct bao_member_t *next;
+                size_t hash;
                 void *member;
         } **buckets;
+        struct bao_member_t **old_buckets;
+        size_t old_size;
+        size_t rehash;
+        size_t min_size;
+        bao_pool_t pool;
+        bao_allocator_t allocator;
 };
 
 typedef struct bao_set_t *bao_set_t;
 
+/*
+ * Cursor over a set's buckets and chains. While it is in use the set may
+ * only be read (bao_set_inside and the like); any other call that modifies it,
+ * including inserting or removing, invalidates the cursor. Entries can be
+ * dropped during iteration only through bao_set_iter_remove.
+ */
+struct bao_set_iter_t {
+        bao_set_t set;
+        size_t bucket;
+        struct bao_member_t **link;
+        struct bao_member_t **prev;
+};
+
 struct bao_bvhnode_t {
         aabb_t bbox;
         size_t left, right;
@@ -141,55 +629,354 @@ typedef struct bao_bvhnode_t *bao_bvhnode_t;
 
 BAOLIBDEF void bao_log_message(const char *fmt, ...);
 BAOLIBDEF const char *bao_log_pop_message(void);
+#ifdef BAO_LOG_DRAIN
+BAOLIBDEF size_t      bao_log_drain(int fd);
+#ifdef BAO_THREADS
+BAOLIBDEF int         bao_log_drain_start(int fd, unsigned interval_ms);
+BAOLIBDEF void        bao_log_drain_stop(void);
+#endif /* BAO_THREADS */
+#endif /* BAO_LOG_DRAIN */
+
+BAOLIBDEF uint64_t    bao_hash_u64(uint64_t x, uint64_t seed);
+BAOLIBDEF uint64_t    bao_hash_bytes(const void *data, size_t len, uint64_t seed);
+BAOLIBDEF uint64_t    bao_hash_cstring(const char *s, uint64_t seed);
+BAOLIBDEF uint64_t    bao_hash_lstring(const struct bao_lstring_t *s, uint64_t seed);
+BAOLIBDEF size_t      bao_hash_ptr(const void *key);
+BAOLIBDEF int         bao_compare_ptr(const void *a, const void *b);
+BAOLIBDEF size_t      bao_hash_u64p(const void *key);
+BAOLIBDEF int         bao_compare_u64p(const void *a, const void *b);
+BAOLIBDEF size_t      bao_hash_str(const void *key);
+BAOLIBDEF int         bao_compare_str(const void *a, const void *b);
+BAOLIBDEF size_t      bao_hash_lstr(const void *key);
+BAOLIBDEF int         bao_compare_lstr(const void *a, const void *b);
 
 BAOLIBDEF bao_arena_t bao_arena_create(void);
+BAOLIBDEF bao_arena_t bao_arena_create2(bao_allocator_t allocator);
+BAOLIBDEF bao_arena_t bao_arena_create_policy(const struct bao_arena_policy_t *policy,
+                                              bao_allocator_t allocator);
+BAOLIBDEF bao_allocator_t bao_arena_allocator(bao_arena_t arena);
 BAOLIBDEF void *      bao_arena_alloc(bao_arena_t arena, size_t size);
 BAOLIBDEF void *      bao_arena_calloc(bao_arena_t arena, size_t nmemb, size_t size);
 BAOLIBDEF void        bao_arena_free(bao_arena_t arena);
+BAOLIBDEF void        bao_arena_mark(bao_arena_t arena, struct bao_arena_mark_t *mark);
+BAOLIBDEF void        bao_arena_rewind(bao_arena_t arena,
+                                       const struct bao_arena_mark_t *mark);
 BAOLIBDEF void        bao_arena_release(bao_arena_t *arena);
 
+#ifdef BAO_THREADS
+BAOLIBDEF bao_chunkpool_t bao_chunkpool_create(const struct bao_arena_policy_t *policy,
+                                               bao_allocator_t allocator);
+BAOLIBDEF bao_arena_t     bao_chunkpool_arena(bao_chunkpool_t pool);
+BAOLIBDEF void            bao_chunkpool_release(bao_chunkpool_t *pool);
+
+BAOLIBDEF bao_carena_t bao_carena_create(const struct bao_arena_policy_t *policy,
+                                         bao_allocator_t allocator);
+BAOLIBDEF void *       bao_carena_alloc(bao_carena_t arena, size_t size);
+BAOLIBDEF void *       bao_carena_calloc(bao_carena_t arena, size_t nmemb, size_t size);
+BAOLIBDEF void         bao_carena_free(bao_carena_t arena);
+BAOLIBDEF void         bao_carena_release(bao_carena_t *arena);
+
+BAOLIBDEF bao_threadpool_t bao_threadpool_create(size_t nthreads);
+BAOLIBDEF size_t           bao_threadpool_size(bao_threadpool_t pool);
+BAOLIBDEF size_t           bao_threadpool_worker(bao_threadpool_t pool);
+BAOLIBDEF int              bao_threadpool_submit(bao_threadpool_t pool,
+                                                 void (*fn)(void *), void *arg);
+BAOLIBDEF void             bao_threadpool_wait(bao_threadpool_t pool);
+BAOLIBDEF int              bao_threadpool_for(bao_threadpool_t pool, size_t begin,
+                                              size_t end, size_t grain,
+                                              void (*body)(size_t, size_t, void *),
+                                              void *arg);
+BAOLIBDEF void             bao_threadpool_release(bao_threadpool_t *pool);
+#endif /* BAO_THREADS */
+
+BAOLIBDEF bao_pool_t  bao_pool_create(size_t memb_size, size_t count,
+                                     bao_arena_t arena);
+BAOLIBDEF void *      bao_pool_alloc(bao_pool_t pool);
+BAOLIBDEF void        bao_pool_put(bao_pool_t pool, void *p);
+BAOLIBDEF void        bao_pool_free(bao_pool_t pool);
+BAOLIBDEF void        bao_pool_release(bao_pool_t *pool);
+
 BAOLIBDEF bao_array_t bao_array_create(size_t size, size_t memb_size);
+BAOLIBDEF bao_array_t bao_array_create2(size_t size, size_t memb_size,
+                                        bao_allocator_t allocator);
+BAOLIBDEF bao_array_t bao_array_create_raw(size_t size, size_t memb_size,
+                                           bao_allocator_t allocator);
+BAOLIBDEF bao_array_t bao_array_create_small(size_t capacity, size_t memb_size,
+                                             bao_allocator_t allocator);
+BAOLIBDEF void        bao_array_init(bao_array_t array, void *buf, size_t capacity,
+                                     size_t memb_size, bao_allocator_t allocator);
+BAOLIBDEF void        bao_array_fini(bao_array_t array);
 BAOLIBDEF size_t      bao_array_size(bao_array_t array);
 BAOLIBDEF size_t      bao_array_capacity(bao_array_t array);
 BAOLIBDEF int         bao_array_empty(bao_array_t array);
+BAOLIBDEF int         bao_array_grow(bao_array_t array, size_t min_capacity);
+BAOLIBDEF int         bao_array_reserve(bao_array_t array, size_t capacity);
+BAOLIBDEF int         bao_array_resize(bao_array_t array, size_t size);
+BAOLIBDEF int         bao_array_shrink_to_fit(bao_array_t array);
 BAOLIBDEF int         bao_array_insert(bao_array_t array, void *v);
 BAOLIBDEF int         bao_array_insert2(bao_array_t array, void *vs, const size_t count);
 BAOLIBDEF int         bao_array_insert_at(bao_array_t array, void *v, size_t index);
+BAOLIBDEF int         bao_array_insert_range(bao_array_t array, size_t index,
+                                           const void *vs, size_t count);
+BAOLIBDEF void        bao_array_erase(bao_array_t array, size_t index, size_t count);
+BAOLIBDEF void        bao_array_swap_remove(bao_array_t array, size_t index);
 BAOLIBDEF void        bao_array_apply(bao_array_t array, void (*apply)(void *));
+#ifdef BAO_THREADS
+BAOLIBDEF int         bao_array_apply_parallel(bao_array_t array, bao_threadpool_t pool,
+                                             size_t grain,
+                                             void (*apply)(void *, void *),
+                                             void *ctx, size_t ctx_size);
+#endif /* BAO_THREADS */
 BAOLIBDEF void *      bao_array_pop(bao_array_t array);
 BAOLIBDEF void *      bao_array_get(bao_array_t array, size_t i);
 BAOLIBDEF void        bao_array_clear(bao_array_t array);
+BAOLIBDEF void        bao_array_reset(bao_array_t array);
 BAOLIBDEF void *      bao_array_find(bao_array_t array, void *v,
                                      int (*compare)(void *, void *));
+BAOLIBDEF size_t      bao_array_find_bytes(bao_array_t array, const void *v);
+BAOLIBDEF size_t      bao_array_count_bytes(bao_array_t array, const void *v);
+BAOLIBDEF void        bao_array_sort(bao_array_t array,
+                                     int (*compare)(void *, void *));
+BAOLIBDEF int         bao_array_radix_sort(bao_array_t array, int key,
+                                           size_t offset);
+BAOLIBDEF void *      bao_array_bsearch(bao_array_t array, void *v,
+                                        int (*compare)(void *, void *));
+BAOLIBDEF size_t      bao_array_lower_bound(bao_array_t array, void *v,
+                                            int (*compare)(void *, void *));
+BAOLIBDEF size_t      bao_array_upper_bound(bao_array_t array, void *v,
+                                            int (*compare)(void *, void *));
 BAOLIBDEF void        bao_array_free(bao_array_t *array);
 
+/*
+ * Declares a typed array name##_t holding elements of type T. It wraps a
+ * bao_array_t, so it grows and is freed exactly like one, but element
+ * access is inlined with the element size known at compile time. The
+ * wrapped array is available through name##_array for the generic API.
+ */
+#define BAO_ARRAY_DEFINE(name, T)                                       \
+        struct name##_t {                                               \
+                struct bao_array_t array;                               \
+        };                                                              \
+                                                                        \
+        typedef struct name##_t *name##_t;                              \
+                                                                        \
+        static inline name##_t name##_create2(size_t size,              \
+                                              bao_allocator_t allocator) \
+        {                                                               \
+                return (name##_t) bao_array_create2(size, sizeof(T),    \
+                                                    allocator);         \
+        }                                                               \
+                                                                        \
+        static inline name##_t name##_create(size_t size)               \
+        {                                                               \
+                return name##_create2(size, NULL);                      \
+        }                                                               \
+                                                                        \
+        static inline name##_t name##_create_raw(size_t size,           \
+                                                 bao_allocator_t allocator) \
+        {                                                               \
+                return (name##_t) bao_array_create_raw(size, sizeof(T), \
+                                                       allocator);      \
+        }                                                               \
+                                                                        \
+        static inline name##_t name##_create_small(size_t capacity,     \
+                                                   bao_allocator_t allocator) \
+        {                                                               \
+                return (name##_t) bao_array_create_small(capacity, sizeof(T), \
+                                                         allocator);    \
+        }                                                               \
+                                                                        \
+        static inline void name##_init(struct name##_t *a, T *buf,      \
+                                       size_t capacity,                 \
+                                       bao_allocator_t allocator)       \
+        {                                                               \
+                bao_array_init(&a->array, buf, capacity, sizeof(T), allocator); \
+        }                                                               \
+                                                                        \
+        static inline void name##_fini(struct name##_t *a)              \
+        {                                                               \
+                bao_array_fini(&a->array);                              \
+        }                                                               \
+                                                                        \
+        static inline bao_array_t name##_array(name##_t a)              \
+        {                                                               \
+                return &a->array;                                       \
+        }                                                               \
+                                                                        \
+        static inline size_t name##_size(name##_t a)                    \
+        {                                                               \
+                return a->array.size;                                   \
+        }                                                               \
+                                                                        \
+        static inline T *name##_data(name##_t a)                        \
+        {                                                               \
+                return (T *) a->array.data;                             \
+        }                                                               \
+                                                                        \
+        static inline T *name##_at(name##_t a, size_t i)                \
+        {                                                               \
+                assert(i < a->array.size);                              \
+                return (T *) a->array.data + i;                         \
+        }                                                               \
+                                                                        \
+        static inline int name##_push(name##_t a, T v)                  \
+        {                                                               \
+                int ret;                                                \
+                if (a->array.size == a->array.capacity) {               \
+                        ret = bao_array_grow(&a->array, a->array.size + 1); \
+                        if (ret != 0) return ret;                       \
+                }                                                       \
+                ((T *) a->array.data)[a->array.size++] = v;             \
+                return 0;                                               \
+        }                                                               \
+                                                                        \
+        static inline T name##_pop(name##_t a)                          \
+        {                                                               \
+                assert(a->array.size > 0);                              \
+                return ((T *) a->array.data)[--a->array.size];          \
+        }                                                               \
+                                                                        \
+        static inline void name##_clear(name##_t a)                     \
+        {                                                               \
+                bao_array_clear(&a->array);                             \
+        }                                                               \
+                                                                        \
+        static inline void name##_reset(name##_t a)                     \
+        {                                                               \
+                a->array.size = 0;                                      \
+        }                                                               \
+                                                                        \
+        static inline void name##_free(name##_t *a)                     \
+        {                                                               \
+                bao_array_t arr = &(*a)->array;                         \
+                bao_array_free(&arr);                                   \
+                *a = NULL;                                              \
+        }
+
 BAOLIBDEF bao_list_t  bao_list_create(void *v);
 BAOLIBDEF bao_list_t  bao_list_push(bao_list_t list, void *v);
 BAOLIBDEF bao_list_t  bao_list_pop(bao_list_t list, void **v);
 BAOLIBDEF void *      bao_list_get(bao_list_t list, size_t i);
 BAOLIBDEF bao_list_t  bao_list_append(bao_list_t a_list, bao_list_t b_list);
 BAOLIBDEF void        bao_list_free(bao_list_t *list);
+BAOLIBDEF bao_list_t  bao_list_create2(void *v, bao_allocator_t allocator);
+BAOLIBDEF bao_list_t  bao_list_push2(bao_list_t list, void *v,
+                                     bao_allocator_t allocator);
+BAOLIBDEF bao_list_t  bao_list_pop2(bao_list_t list, void **v,
+                                    bao_allocator_t allocator);
+BAOLIBDEF void        bao_list_free2(bao_list_t *list, bao_allocator_t allocator);
+BAOLIBDEF bao_list_t  bao_list_create_pool(bao_pool_t pool, void *v);
+BAOLIBDEF bao_list_t  bao_list_push_pool(bao_pool_t pool, bao_list_t list, void *v);
+BAOLIBDEF bao_list_t  bao_list_pop_pool(bao_pool_t pool, bao_list_t list, void **v);
 
 BAOLIBDEF bao_map_t bao_map_create(size_t hint,
                                    int (*compare)(const void *, const void *),
                                    size_t hash(const void *));
+BAOLIBDEF bao_map_t bao_map_create2(size_t hint,
+                                    int (*compare)(const void *, const void *),
+                                    size_t (*hash)(const void *),
+                                    bao_allocator_t allocator);
+BAOLIBDEF bao_map_t bao_map_create_pooled(size_t hint,
+                                          int (*compare)(const void *, const void *),
+                                          size_t (*hash)(const void *),
+                                          bao_arena_t arena);
 BAOLIBDEF int       bao_map_insert(bao_map_t map, void *key, void *v,
                                    void **prev);
 BAOLIBDEF int       bao_map_remove(bao_map_t map, const void *key,
                                    void **fkey, void **fv);
 BAOLIBDEF void *    bao_map_find(bao_map_t map, void *key);
+BAOLIBDEF size_t    bao_map_find_batch(bao_map_t map, void **keys, size_t n,
+                                       void **values);
 BAOLIBDEF void      bao_map_apply(bao_map_t map, void (*apply)(void *, void *, void *),
                                   void *arg);
+#ifdef BAO_THREADS
+BAOLIBDEF int       bao_map_apply_parallel(bao_map_t map, bao_threadpool_t pool,
+                                           size_t grain,
+                                           void (*apply)(void *, void *, void *),
+                                           void *ctx, size_t ctx_size);
+#endif /* BAO_THREADS */
+BAOLIBDEF void      bao_map_iter_init(bao_map_t map, struct bao_map_iter_t *it);
+BAOLIBDEF int       bao_map_iter_next(struct bao_map_iter_t *it, void **key,
+                                      void **value);
+BAOLIBDEF void      bao_map_iter_remove(struct bao_map_iter_t *it);
 BAOLIBDEF size_t    bao_map_length(bao_map_t map);
+BAOLIBDEF bao_frozenmap_t bao_map_freeze(bao_map_t map);
 BAOLIBDEF void      bao_map_free(bao_map_t *map);
 
+BAOLIBDEF bao_flatmap_t bao_flatmap_create(size_t hint,
+                                           int (*compare)(const void *, const void *),
+                                           size_t (*hash)(const void *));
+BAOLIBDEF int          bao_flatmap_insert(bao_flatmap_t map, void *key, void *v,
+                                          void **prev);
+BAOLIBDEF int          bao_flatmap_remove(bao_flatmap_t map, const void *key,
+                                          void **fkey, void **fv);
+BAOLIBDEF void *       bao_flatmap_find(bao_flatmap_t map, const void *key);
+BAOLIBDEF void         bao_flatmap_apply(bao_flatmap_t map,
+                                         void (*apply)(void *, void *, void *),
+                                         void *arg);
+BAOLIBDEF size_t       bao_flatmap_length(bao_flatmap_t map);
+BAOLIBDEF void         bao_flatmap_free(bao_flatmap_t *map);
+
+BAOLIBDEF void *    bao_frozenmap_find(bao_frozenmap_t map, const void *key);
+BAOLIBDEF void      bao_frozenmap_apply(bao_frozenmap_t map,
+                                        void (*apply)(void *, void *, void *),
+                                        void *arg);
+BAOLIBDEF size_t    bao_frozenmap_length(bao_frozenmap_t map);
+BAOLIBDEF void      bao_frozenmap_free(bao_frozenmap_t *map);
+
+BAOLIBDEF int          bao_array_write(bao_array_t array, const char *path);
+BAOLIBDEF int          bao_frozenmap_write(bao_frozenmap_t map, const char *path,
+                                           size_t (*encode_key)(const void *, void *, size_t),
+                                           size_t (*encode_value)(const void *, void *, size_t));
+BAOLIBDEF bao_mapped_t bao_mapped_open(const char *path);
+BAOLIBDEF int          bao_mapped_array(bao_mapped_t file, struct bao_array_t *array);
+BAOLIBDEF const void * bao_mapped_find(bao_mapped_t file, const void *key,
+                                       size_t key_size, size_t hash,
+                                       size_t *value_size);
+BAOLIBDEF size_t       bao_mapped_length(bao_mapped_t file);
+BAOLIBDEF int          bao_mapped_verify(bao_mapped_t file);
+BAOLIBDEF void         bao_mapped_close(bao_mapped_t *file);
+
+#ifdef BAO_THREADS
+BAOLIBDEF bao_cmap_t bao_cmap_create(size_t hint, size_t nsegments,
+                                     int (*compare)(const void *, const void *),
+                                     size_t (*hash)(const void *));
+BAOLIBDEF int        bao_cmap_insert(bao_cmap_t map, void *key, void *v,
+                                     void **prev);
+BAOLIBDEF int        bao_cmap_remove(bao_cmap_t map, const void *key,
+                                     void **fkey, void **fv);
+BAOLIBDEF void *     bao_cmap_find(bao_cmap_t map, const void *key);
+BAOLIBDEF void       bao_cmap_apply(bao_cmap_t map,
+                                    void (*apply)(void *, void *, void *),
+                                    void *arg);
+BAOLIBDEF size_t     bao_cmap_length(bao_cmap_t map);
+BAOLIBDEF void       bao_cmap_free(bao_cmap_t *map);
+#endif /* BAO_THREADS */
+
 BAOLIBDEF bao_set_t bao_set_create(size_t hint,
                                    int (*compare)(const void *, const void *),
                                    size_t (*hash)(const void *));
+BAOLIBDEF bao_set_t bao_set_create2(size_t hint,
+                                    int (*compare)(const void *, const void *),
+                                    size_t (*hash)(const void *),
+                                    bao_allocator_t allocator);
+BAOLIBDEF bao_set_t bao_set_create_pooled(size_t hint,
+                                          int (*compare)(const void *, const void *),
+                                          size_t (*hash)(const void *),
+                                          bao_arena_t arena);
 BAOLIBDEF int       bao_set_insert(bao_set_t set, void *member, void **prev);
 BAOLIBDEF void *    bao_set_inside(bao_set_t set, void *member);
 BAOLIBDEF void      bao_set_apply(bao_set_t set, void (*apply)(void *, void *),
                                   void *arg);
+#ifdef BAO_THREADS
+BAOLIBDEF int       bao_set_apply_parallel(bao_set_t set, bao_threadpool_t pool,
+                                           size_t grain,
+                                           void (*apply)(void *, void *),
+                                           void *ctx, size_t ctx_size);
+#endif /* BAO_THREADS */
+BAOLIBDEF void      bao_set_iter_init(bao_set_t set, struct bao_set_iter_t *it);
+BAOLIBDEF int       bao_set_iter_next(struct bao_set_iter_t *it, void **member);
+BAOLIBDEF void      bao_set_iter_remove(struct bao_set_iter_t *it);
 BAOLIBDEF bao_set_t bao_set_copy(bao_set_t set, size_t size);
 BAOLIBDEF bao_set_t bao_set_union(bao_set_t set_a, bao_set_t set_b);
 BAOLIBDEF void      bao_set_free(bao_set_t *set);
@@ -213,614 +1000,4990 @@ static size_t bao_npo2(size_t n)
         return n;
 }
 
-#ifdef BAO_LOG
-static char bao_log_stack[BAO_LOG_STACK_CAPACITY][BAO_LOG_MESSAGE_CAPACITY];
-static int bao_log_stack_ptr;
-static int bao_log_stack_size;
-
-static int bao_log_empty(void)
+static unsigned bao_ctz(unsigned mask)
 {
-        return bao_log_stack_size == 0;
+#if defined(__GNUC__) || defined(__clang__)
+        return (unsigned) __builtin_ctz(mask);
+#else /* !defined(__GNUC__) && !defined(__clang__) */
+        unsigned n = 0;
+        while (!(mask & 1)) {
+                mask >>= 1;
+                n++;
+        }
+        return n;
+#endif /* __GNUC__ || __clang__ */
 }
 
-static int bao_log_full(void)
+#ifdef BAO_SSE2
+static unsigned bao_popcount(unsigned mask)
 {
-        return bao_log_stack_size == BAO_LOG_STACK_CAPACITY;
+#if defined(__GNUC__) || defined(__clang__)
+        return (unsigned) __builtin_popcount(mask);
+#else /* !defined(__GNUC__) && !defined(__clang__) */
+        unsigned n = 0;
+        for (; mask; mask &= mask - 1)
+                n++;
+        return n;
+#endif /* __GNUC__ || __clang__ */
 }
-#endif /* BAO_LOG */
+#endif /* BAO_SSE2 */
 
-BAOLIBDEF void bao_log_message(const char *fmt, ...)
+static uint64_t bao_hash_mix(uint64_t h)
 {
-#ifdef BAO_LOG
-        va_list args;
-        if (!bao_log_full()) {
-                bao_log_stack_size++;
-        }
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+}
 
-        va_start(args, fmt);
-        vsnprintf((char *) (bao_log_stack + bao_log_stack_ptr),
-                  BAO_LOG_MESSAGE_CAPACITY - 1, fmt, args);
-        va_end(args);
-        bao_log_stack_ptr = (bao_log_stack_ptr + 1) % BAO_LOG_STACK_CAPACITY;
-#else /* !defined(BAO_LOG) */
-        (void) 0;
-#endif /* BAO_LOG */
+#define BAO_HASH_SECRET0 UINT64_C(0xa0761d6478bd642f)
+#define BAO_HASH_SECRET1 UINT64_C(0xe7037ed1a0b428db)
+#define BAO_HASH_SECRET2 UINT64_C(0x8ebc6af09c88c6e3)
+#define BAO_HASH_SECRET3 UINT64_C(0x589965cc75374cc3)
+
+/*
+ * Multiplies a and b into 128 bits and returns the two halves in a and b.
+ */
+static void bao_hash_mum(uint64_t *a, uint64_t *b)
+{
+#if defined(__SIZEOF_INT128__)
+        __uint128_t r = (__uint128_t) *a * *b;
+        *a = (uint64_t) r;
+        *b = (uint64_t) (r >> 64);
+#else /* !defined(__SIZEOF_INT128__) */
+        uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t) *a, lb = (uint32_t) *b;
+        uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+        uint64_t t = rl + (rm0 << 32), c = t < rl, lo;
+        lo = t + (rm1 << 32);
+        c += lo < t;
+        *a = lo;
+        *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif /* __SIZEOF_INT128__ */
 }
 
-BAOLIBDEF const char *bao_log_pop_message(void)
+static uint64_t bao_hash_fold(uint64_t a, uint64_t b)
 {
-#ifdef BAO_LOG
-        if (!bao_log_empty()) {
-                bao_log_stack_size--;
-                bao_log_stack_ptr--;
-                if (bao_log_stack_ptr < 0) {
-                        bao_log_stack_ptr += BAO_LOG_STACK_CAPACITY;
-                }
-                return (const char *) bao_log_stack[bao_log_stack_ptr];
-        }
-        return "No Errors";
-#else /* !defined(BAO_LOG) */
-        return "Debugging disabled!";
-#endif /* BAO_LOG */
+        bao_hash_mum(&a, &b);
+        return a ^ b;
 }
 
-BAOLIBDEF bao_arena_t bao_arena_create(void)
+static uint64_t bao_hash_read8(const unsigned char *p)
 {
-        bao_arena_t arena = BAO_MALLOC(sizeof(*arena));
-        if (!arena) {
-                BAO_LOG_MESSAGE("Ran out of memory!");
-                return NULL;
-        }
+        uint64_t v;
+        memcpy(&v, p, 8);
+        return v;
+}
 
-        arena->bao_arena_freechunks = NULL;
-        arena->bao_arena_nfree = 0;
-        arena->first = BAO_MALLOC(sizeof(*arena->first));
-        if (!arena->first) {
-                BAO_LOG_MESSAGE("Ran out of memory!");
-                BAO_FREE(arena);
-                return NULL;
-        }
+static uint64_t bao_hash_read4(const unsigned char *p)
+{
+        uint32_t v;
+        memcpy(&v, p, 4);
+        return v;
+}
 
-        arena->first->prev = NULL;
-        arena->first->limit = arena->first->avail = NULL;
-        return arena;
+/*
+ * Hashes a 64-bit integer.
+ */
+BAOLIBDEF uint64_t bao_hash_u64(uint64_t x, uint64_t seed)
+{
+        return bao_hash_mix(x ^ bao_hash_mix(seed ^ BAO_HASH_SECRET0));
 }
 
-BAOLIBDEF void *bao_arena_alloc(bao_arena_t arena, size_t size)
+/*
+ * Hashes len bytes at p, in the style of wyhash. Inputs longer than 48
+ * bytes go through three independent multiply lanes, so consecutive
+ * blocks do not wait on each other.
+ */
+BAOLIBDEF uint64_t bao_hash_bytes(const void *data, size_t len, uint64_t seed)
 {
-        assert(arena);
-        assert(size > 0);
-        size = ((size + sizeof(union bao_align_t) - 1) /
-                (sizeof(union bao_align_t))) * (sizeof(union bao_align_t));
-        bao_arena_chunk_t first = arena->first;
-        while (size > first->limit - first->avail) {
-                char *limit;
-                bao_arena_chunk_t new_arena_chunk;
-                if ((new_arena_chunk = arena->bao_arena_freechunks) != NULL) {
-                        arena->bao_arena_freechunks = arena->bao_arena_freechunks->prev;
-                        arena->bao_arena_nfree--;
-                        limit = new_arena_chunk->limit;
+        const unsigned char *p = data;
+        uint64_t a, b, see1, see2;
+        size_t i = len;
+
+        seed ^= bao_hash_fold(seed ^ BAO_HASH_SECRET0, BAO_HASH_SECRET1);
+        if (len <= 16) {
+                if (len >= 4) {
+                        a = (bao_hash_read4(p) << 32) | bao_hash_read4(p + ((len >> 3) << 2));
+                        b = (bao_hash_read4(p + len - 4) << 32)
+                                | bao_hash_read4(p + len - 4 - ((len >> 3) << 2));
+                } else if (len > 0) {
+                        a = ((uint64_t) p[0] << 16) | ((uint64_t) p[len >> 1] << 8) | p[len - 1];
+                        b = 0;
                 } else {
-                        size_t m = sizeof(union bao_header_t) + size + 10*1024;
-                        new_arena_chunk = BAO_MALLOC(m);
-                        if (new_arena_chunk == NULL) {
-                                BAO_LOG_MESSAGE("Ran out of memory!");
-                                return NULL;
-                        }
-                        limit = (char *) new_arena_chunk + m;
+                        a = b = 0;
                 }
-                *new_arena_chunk = *first;
-                first->avail = (char *)((union bao_header_t *) new_arena_chunk + 1);
-                first->limit = limit;
-                first->prev  = new_arena_chunk;
+        } else {
+                if (i > 48) {
+                        see1 = see2 = seed;
+                        do {
+                                seed = bao_hash_fold(bao_hash_read8(p) ^ BAO_HASH_SECRET1,
+                                                     bao_hash_read8(p + 8) ^ seed);
+                                see1 = bao_hash_fold(bao_hash_read8(p + 16) ^ BAO_HASH_SECRET2,
+                                                     bao_hash_read8(p + 24) ^ see1);
+                                see2 = bao_hash_fold(bao_hash_read8(p + 32) ^ BAO_HASH_SECRET3,
+                                                     bao_hash_read8(p + 40) ^ see2);
+                                p += 48;
+                                i -= 48;
+                        } while (i > 48);
+                        seed ^= see1 ^ see2;
+                }
+                while (i > 16) {
+                        seed = bao_hash_fold(bao_hash_read8(p) ^ BAO_HASH_SECRET1,
+                                             bao_hash_read8(p + 8) ^ seed);
+                        p += 16;
+                        i -= 16;
+                }
+                a = bao_hash_read8(p + i - 16);
+                b = bao_hash_read8(p + i - 8);
         }
-        first->avail += size;
-        return first->avail - size;
+
+        a ^= BAO_HASH_SECRET1;
+        b ^= seed;
+        bao_hash_mum(&a, &b);
+        return bao_hash_fold(a ^ BAO_HASH_SECRET0 ^ len, b ^ BAO_HASH_SECRET1);
 }
 
-BAOLIBDEF void *bao_arena_calloc(bao_arena_t arena, size_t nmemb, size_t size)
+BAOLIBDEF uint64_t bao_hash_cstring(const char *s, uint64_t seed)
 {
-        void *ptr;
-
-        assert(size > 0);
-        assert(nmemb > 0);
-
-        ptr = bao_arena_alloc(arena, nmemb * size);
-        if (!ptr) {
-                return NULL;
-        }
-
-        memset(ptr, '\0', nmemb * size);
-        return ptr;
+        assert(s);
+        return bao_hash_bytes(s, strlen(s), seed);
 }
 
-#define BAO_ARENA_THRESHOLD (10)
-
-BAOLIBDEF void bao_arena_free(bao_arena_t arena)
+BAOLIBDEF uint64_t bao_hash_lstring(const struct bao_lstring_t *s, uint64_t seed)
 {
-        assert(arena);
-        bao_arena_chunk_t first = arena->first;
-        while (first->prev) {
-                struct bao_arena_chunk_t tmp = *first->prev;
-                if (arena->bao_arena_nfree < BAO_ARENA_THRESHOLD) {
-                        first->prev->prev = arena->bao_arena_freechunks;
-                        arena->bao_arena_freechunks = first->prev;
-                        arena->bao_arena_nfree++;
-                        arena->bao_arena_freechunks->limit = first->limit;
-                } else {
-                        BAO_FREE(first->prev);
-                }
-                *first = tmp;
-        }
+        assert(s);
+        return bao_hash_bytes(s->data, s->length, seed);
+}
 
-        assert(first->limit == NULL);
-        assert(first->avail == NULL);
+/*
+ * Ready-made hash and compare callbacks. _ptr keys are integers stored in
+ * the key pointer itself, _u64 keys point to a uint64_t, _str keys are C
+ * strings and _lstr keys point to a struct bao_lstring_t.
+ */
+BAOLIBDEF size_t bao_hash_ptr(const void *key)
+{
+        return (size_t) bao_hash_u64((uint64_t) (uintptr_t) key, BAO_HASH_SEED);
 }
 
-BAOLIBDEF void bao_arena_release(bao_arena_t *arena)
+BAOLIBDEF int bao_compare_ptr(const void *a, const void *b)
 {
-        assert(arena && *arena);
-        bao_arena_chunk_t first = (*arena)->first;
-        while (first->prev) {
-                bao_arena_chunk_t tmp = first->prev;
-                BAO_FREE(first);
-                first = tmp;
-        }
-        BAO_FREE(first);
-        BAO_FREE(*arena);
+        return ((uintptr_t) a > (uintptr_t) b) - ((uintptr_t) a < (uintptr_t) b);
 }
 
-BAOLIBDEF bao_array_t bao_array_create(size_t size, size_t memb_size)
+BAOLIBDEF size_t bao_hash_u64p(const void *key)
 {
-        bao_array_t array;
-        assert(memb_size > 0);
+        return (size_t) bao_hash_u64(*(const uint64_t *) key, BAO_HASH_SEED);
+}
 
-        array = BAO_MALLOC(sizeof(*array));
-        if (!array) {
+BAOLIBDEF int bao_compare_u64p(const void *a, const void *b)
+{
+        uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+        return (x > y) - (x < y);
+}
+
+BAOLIBDEF size_t bao_hash_str(const void *key)
+{
+        return (size_t) bao_hash_cstring(key, BAO_HASH_SEED);
+}
+
+BAOLIBDEF int bao_compare_str(const void *a, const void *b)
+{
+        return strcmp(a, b);
+}
+
+BAOLIBDEF size_t bao_hash_lstr(const void *key)
+{
+        return (size_t) bao_hash_lstring(key, BAO_HASH_SEED);
+}
+
+BAOLIBDEF int bao_compare_lstr(const void *a, const void *b)
+{
+        const struct bao_lstring_t *x = a, *y = b;
+        int ret = memcmp(x->data, y->data, BAO_MIN(x->length, y->length));
+        if (ret != 0)
+                return ret;
+        return (x->length > y->length) - (x->length < y->length);
+}
+
+static void *bao_alloc(bao_allocator_t allocator, size_t size)
+{
+        if (allocator)
+                return allocator->alloc(allocator->ctx, size);
+        return BAO_MALLOC(size);
+}
+
+static void *bao_calloc(bao_allocator_t allocator, size_t nmemb, size_t size)
+{
+        void *p;
+        if (!allocator)
+                return BAO_CALLOC(nmemb, size);
+        if ((p = allocator->alloc(allocator->ctx, nmemb * size)) != NULL)
+                memset(p, 0, nmemb * size);
+        return p;
+}
+
+static void *bao_realloc(bao_allocator_t allocator, void *p,
+                         size_t old_size, size_t new_size)
+{
+        if (allocator)
+                return allocator->realloc(allocator->ctx, p, old_size, new_size);
+        return BAO_REALLOC(p, new_size);
+}
+
+static void bao_dealloc(bao_allocator_t allocator, void *p, size_t size)
+{
+        if (allocator)
+                allocator->free(allocator->ctx, p, size);
+        else
+                BAO_FREE(p);
+}
+
+#define BAO_DEALLOC(allocator, x, size)                                 \
+        ((void) (bao_dealloc(allocator, x, size), x = NULL))
+
+#ifdef BAO_LOG
+/*
+ * Every thread logs into its own ring of BAO_LOG_STACK_CAPACITY entries.
+ * An entry keeps the format pointer and the raw arguments (string
+ * arguments are copied and %n targets are never written), and is only
+ * formatted when it is popped or drained. The ring state packs a version,
+ * the entry count and the index of the next free slot into one word, and
+ * every push, pop and drain is a compare-and-swap on it: the owning thread
+ * pushes and pops the newest entry, drainers on any thread take the
+ * oldest. When the ring is full the oldest entry is dropped. A reader
+ * copies an entry before its compare-and-swap, so a copy torn by a
+ * concurrent push is thrown away when the version check fails.
+ */
+union bao_log_arg_t {
+        long long i;
+        unsigned long long u;
+        double d;
+        long double ld;
+        const void *p;
+};
+
+struct bao_log_entry_t {
+        const char *fmt;
+        union bao_log_arg_t args[BAO_LOG_MAX_ARGS];
+        char strings[BAO_LOG_STRING_CAPACITY];
+};
+
+struct bao_log_ring_t {
+        _Atomic uint64_t state;
+        struct bao_log_entry_t entries[BAO_LOG_STACK_CAPACITY];
+        char message[BAO_LOG_MESSAGE_CAPACITY];
+#ifdef BAO_THREADS
+        int registered;
+        struct bao_log_ring_t *next;
+#endif /* BAO_THREADS */
+};
+
+#define BAO_LOG_STATE(version, count, top)                              \
+        (((uint64_t) (version) << 16) | ((uint64_t) (count) << 8) | (uint64_t) (top))
+#define BAO_LOG_VERSION(state) ((state) >> 16)
+#define BAO_LOG_COUNT(state) ((size_t) (((state) >> 8) & 0xff))
+#define BAO_LOG_TOP(state) ((size_t) ((state) & 0xff))
+
+static _Thread_local struct bao_log_ring_t bao_log_ring;
+
+/*
+ * A parsed conversion specification. Integer arguments are widened to long
+ * long when they are captured, so the specification is printed again with
+ * its length modifier replaced by the one of the widened type.
+ */
+struct bao_log_spec_t {
+        const char *start;
+        const char *length;
+        const char *end;
+        char conv;
+        char modifier[3];
+        int stars;
+};
+
+static const char *bao_log_parse_spec(const char *fmt, struct bao_log_spec_t *spec)
+{
+        size_t n = 0;
+
+        spec->start = fmt++;
+        spec->stars = 0;
+        while (*fmt && strchr("-+ #0'", *fmt))
+                fmt++;
+        if (*fmt == '*') {
+                spec->stars++;
+                fmt++;
+        }
+        while (*fmt >= '0' && *fmt <= '9')
+                fmt++;
+        if (*fmt == '.') {
+                fmt++;
+                if (*fmt == '*') {
+                        spec->stars++;
+                        fmt++;
+                }
+                while (*fmt >= '0' && *fmt <= '9')
+                        fmt++;
+        }
+
+        spec->length = fmt;
+        while (*fmt && strchr("hljztL", *fmt) && n < 2)
+                spec->modifier[n++] = *fmt++;
+        spec->modifier[n] = '\0';
+        spec->conv = *fmt;
+        if (*fmt)
+                fmt++;
+        spec->end = fmt;
+        return fmt;
+}
+
+static void bao_log_capture(struct bao_log_entry_t *entry, const char *fmt,
+                            va_list args)
+{
+        struct bao_log_spec_t spec;
+        const char *m, *s;
+        size_t nargs = 0, nstrings = 0, len;
+        int i;
+
+        entry->fmt = fmt;
+        while (*fmt) {
+                if (*fmt != '%') {
+                        fmt++;
+                        continue;
+                }
+
+                fmt = bao_log_parse_spec(fmt, &spec);
+                if (spec.conv == '%' || spec.conv == '\0')
+                        continue;
+                if (nargs + spec.stars + 1 > BAO_LOG_MAX_ARGS)
+                        break;
+
+                for (i = 0; i < spec.stars; i++)
+                        entry->args[nargs++].i = va_arg(args, int);
+
+                m = spec.modifier;
+                switch (spec.conv) {
+                case 'd': case 'i':
+                        if (!strcmp(m, "hh"))
+                                entry->args[nargs].i = (signed char) va_arg(args, int);
+                        else if (!strcmp(m, "h"))
+                                entry->args[nargs].i = (short) va_arg(args, int);
+                        else if (!strcmp(m, "l"))
+                                entry->args[nargs].i = va_arg(args, long);
+                        else if (!strcmp(m, "ll"))
+                                entry->args[nargs].i = va_arg(args, long long);
+                        else if (!strcmp(m, "z"))
+                                entry->args[nargs].i = (long long) va_arg(args, size_t);
+                        else if (!strcmp(m, "j"))
+                                entry->args[nargs].i = va_arg(args, intmax_t);
+                        else if (!strcmp(m, "t"))
+                                entry->args[nargs].i = va_arg(args, ptrdiff_t);
+                        else
+                                entry->args[nargs].i = va_arg(args, int);
+                        break;
+                case 'o': case 'u': case 'x': case 'X':
+                        if (!strcmp(m, "hh"))
+                                entry->args[nargs].u = (unsigned char) va_arg(args, unsigned);
+                        else if (!strcmp(m, "h"))
+                                entry->args[nargs].u = (unsigned short) va_arg(args, unsigned);
+                        else if (!strcmp(m, "l"))
+                                entry->args[nargs].u = va_arg(args, unsigned long);
+                        else if (!strcmp(m, "ll"))
+                                entry->args[nargs].u = va_arg(args, unsigned long long);
+                        else if (!strcmp(m, "z"))
+                                entry->args[nargs].u = va_arg(args, size_t);
+                        else if (!strcmp(m, "j"))
+                                entry->args[nargs].u = va_arg(args, uintmax_t);
+                        else if (!strcmp(m, "t"))
+                                entry->args[nargs].u = (unsigned long long) va_arg(args, ptrdiff_t);
+                        else
+                                entry->args[nargs].u = va_arg(args, unsigned);
+                        break;
+                case 'c':
+                        entry->args[nargs].i = va_arg(args, int);
+                        break;
+                case 'e': case 'E': case 'f': case 'F':
+                case 'g': case 'G': case 'a': case 'A':
+                        if (!strcmp(m, "L"))
+                                entry->args[nargs].ld = va_arg(args, long double);
+                        else
+                                entry->args[nargs].d = va_arg(args, double);
+                        break;
+                case 's':
+                        s = va_arg(args, const char *);
+                        if (!s) s = "(null)";
+                        len = strlen(s);
+                        len = BAO_MIN(len, BAO_LOG_STRING_CAPACITY - 1 - nstrings);
+                        memcpy(entry->strings + nstrings, s, len);
+                        entry->strings[nstrings + len] = '\0';
+                        entry->args[nargs].u = nstrings;
+                        nstrings += len + (nstrings + len < BAO_LOG_STRING_CAPACITY - 1);
+                        break;
+                default:
+                        entry->args[nargs].p = va_arg(args, void *);
+                        break;
+                }
+                nargs++;
+        }
+}
+
+/*
+ * Formats entry into buf, which holds BAO_LOG_MESSAGE_CAPACITY bytes.
+ */
+static void bao_log_format(const struct bao_log_entry_t *entry, char *buf)
+{
+        struct bao_log_spec_t spec;
+        const char *fmt = entry->fmt, *lit;
+        char conv[32];
+        size_t nargs = 0, n = 0, cap = BAO_LOG_MESSAGE_CAPACITY - 1, len;
+        const union bao_log_arg_t *arg;
+        int w = 0, p = 0, ret;
+
+        buf[0] = '\0';
+        while (*fmt && n < cap) {
+                if (*fmt != '%') {
+                        for (lit = fmt; *fmt && *fmt != '%'; fmt++)
+                                ;
+                        len = BAO_MIN((size_t) (fmt - lit), cap - n);
+                        memcpy(buf + n, lit, len);
+                        n += len;
+                        buf[n] = '\0';
+                        continue;
+                }
+
+                fmt = bao_log_parse_spec(fmt, &spec);
+                if (spec.conv == '%') {
+                        buf[n++] = '%';
+                        buf[n] = '\0';
+                        continue;
+                }
+                if (spec.conv == '\0')
+                        continue;
+                if (nargs + spec.stars + 1 > BAO_LOG_MAX_ARGS)
+                        break;
+                if (spec.conv == 'n') {
+                        /* Capture stored the pointer; formatting never writes it. */
+                        nargs += spec.stars + 1;
+                        continue;
+                }
+                if ((size_t) (spec.length - spec.start) + 4 > sizeof(conv))
+                        break;
+
+                /* Rebuild the specification with the captured argument width. */
+                len = spec.length - spec.start;
+                memcpy(conv, spec.start, len);
+                switch (spec.conv) {
+                case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+                        conv[len++] = 'l';
+                        conv[len++] = 'l';
+                        break;
+                case 'e': case 'E': case 'f': case 'F':
+                case 'g': case 'G': case 'a': case 'A':
+                        if (!strcmp(spec.modifier, "L"))
+                                conv[len++] = 'L';
+                        break;
+                }
+                conv[len++] = spec.conv;
+                conv[len] = '\0';
+
+                if (spec.stars > 0) w = (int) entry->args[nargs++].i;
+                if (spec.stars > 1) p = (int) entry->args[nargs++].i;
+                arg = &entry->args[nargs++];
+
+#define BAO_LOG_PRINT(value)                                            \
+        (spec.stars == 0 ? snprintf(buf + n, cap + 1 - n, conv, value)  \
+         : spec.stars == 1 ? snprintf(buf + n, cap + 1 - n, conv, w, value) \
+         : snprintf(buf + n, cap + 1 - n, conv, w, p, value))
+                switch (spec.conv) {
+                case 'd': case 'i':
+                        ret = BAO_LOG_PRINT(arg->i);
+                        break;
+                case 'o': case 'u': case 'x': case 'X':
+                        ret = BAO_LOG_PRINT(arg->u);
+                        break;
+                case 'c':
+                        ret = BAO_LOG_PRINT((int) arg->i);
+                        break;
+                case 'e': case 'E': case 'f': case 'F':
+                case 'g': case 'G': case 'a': case 'A':
+                        if (!strcmp(spec.modifier, "L"))
+                                ret = BAO_LOG_PRINT(arg->ld);
+                        else
+                                ret = BAO_LOG_PRINT(arg->d);
+                        break;
+                case 's':
+                        ret = BAO_LOG_PRINT(entry->strings + arg->u);
+                        break;
+                default:
+                        ret = BAO_LOG_PRINT(arg->p);
+                        break;
+                }
+#undef BAO_LOG_PRINT
+                if (ret < 0)
+                        break;
+                n = BAO_MIN(n + (size_t) ret, cap);
+        }
+}
+
+#ifdef BAO_THREADS
+static struct bao_log_ring_t *bao_log_rings;
+static pthread_mutex_t bao_log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t bao_log_once = PTHREAD_ONCE_INIT;
+static pthread_key_t bao_log_key;
+
+static void bao_log_unregister(void *ring)
+{
+        struct bao_log_ring_t **pp;
+
+        pthread_mutex_lock(&bao_log_lock);
+        for (pp = &bao_log_rings; *pp; pp = &(*pp)->next) {
+                if (*pp == ring) {
+                        *pp = (*pp)->next;
+                        break;
+                }
+        }
+        pthread_mutex_unlock(&bao_log_lock);
+}
+
+static void bao_log_init_key(void)
+{
+        pthread_key_create(&bao_log_key, bao_log_unregister);
+}
+
+/*
+ * Makes the calling thread's ring visible to drains from other threads
+ * until the thread exits.
+ */
+static void bao_log_register(struct bao_log_ring_t *ring)
+{
+        pthread_once(&bao_log_once, bao_log_init_key);
+        pthread_mutex_lock(&bao_log_lock);
+        ring->next = bao_log_rings;
+        bao_log_rings = ring;
+        pthread_mutex_unlock(&bao_log_lock);
+        pthread_setspecific(bao_log_key, ring);
+        ring->registered = 1;
+}
+#endif /* BAO_THREADS */
+
+/*
+ * Takes the oldest entry off ring and formats it into buf. Returns 0 when
+ * the ring is empty.
+ */
+static int bao_log_take_oldest(struct bao_log_ring_t *ring, char *buf)
+{
+        struct bao_log_entry_t entry;
+        uint64_t state;
+        size_t count, top;
+
+        state = atomic_load(&ring->state);
+        do {
+                count = BAO_LOG_COUNT(state);
+                top = BAO_LOG_TOP(state);
+                if (count == 0)
+                        return 0;
+                entry = ring->entries[(top + BAO_LOG_STACK_CAPACITY - count) %
+                                      BAO_LOG_STACK_CAPACITY];
+        } while (!atomic_compare_exchange_weak(&ring->state, &state,
+                                               BAO_LOG_STATE(BAO_LOG_VERSION(state) + 1,
+                                                             count - 1, top)));
+
+        bao_log_format(&entry, buf);
+        return 1;
+}
+
+#ifdef BAO_LOG_DRAIN
+static size_t bao_log_drain_ring(struct bao_log_ring_t *ring, int fd)
+{
+        char buf[BAO_LOG_MESSAGE_CAPACITY + 1];
+        size_t n, drained = 0;
+
+        while (bao_log_take_oldest(ring, buf)) {
+                n = strlen(buf);
+                buf[n++] = '\n';
+                if (fd >= 0 && write(fd, buf, n) < 0)
+                        break;
+                drained++;
+        }
+
+        return drained;
+}
+#endif /* BAO_LOG_DRAIN */
+#endif /* BAO_LOG */
+
+BAOLIBDEF void bao_log_message(const char *fmt, ...)
+{
+#ifdef BAO_LOG
+        struct bao_log_ring_t *ring = &bao_log_ring;
+        struct bao_log_entry_t entry;
+        uint64_t state, next;
+        size_t count, top;
+        va_list args;
+
+#ifdef BAO_THREADS
+        if (!ring->registered)
+                bao_log_register(ring);
+#endif /* BAO_THREADS */
+
+        va_start(args, fmt);
+        bao_log_capture(&entry, fmt, args);
+        va_end(args);
+
+        state = atomic_load(&ring->state);
+        for (;;) {
+                count = BAO_LOG_COUNT(state);
+                top = BAO_LOG_TOP(state);
+                if (count == BAO_LOG_STACK_CAPACITY) {
+                        /* Drop the oldest entry before reusing its slot. */
+                        next = BAO_LOG_STATE(BAO_LOG_VERSION(state) + 1, count - 1, top);
+                        if (atomic_compare_exchange_weak(&ring->state, &state, next))
+                                state = next;
+                        continue;
+                }
+
+                ring->entries[top] = entry;
+                next = BAO_LOG_STATE(BAO_LOG_VERSION(state) + 1, count + 1,
+                                     (top + 1) % BAO_LOG_STACK_CAPACITY);
+                if (atomic_compare_exchange_weak(&ring->state, &state, next))
+                        break;
+        }
+#else /* !defined(BAO_LOG) */
+        (void) 0;
+#endif /* BAO_LOG */
+}
+
+/*
+ * Pops and formats the calling thread's newest message. The returned string
+ * stays valid until the thread's next call.
+ */
+BAOLIBDEF const char *bao_log_pop_message(void)
+{
+#ifdef BAO_LOG
+        struct bao_log_ring_t *ring = &bao_log_ring;
+        struct bao_log_entry_t entry;
+        uint64_t state;
+        size_t count, top;
+
+        state = atomic_load(&ring->state);
+        do {
+                count = BAO_LOG_COUNT(state);
+                top = BAO_LOG_TOP(state);
+                if (count == 0)
+                        return "No Errors";
+                top = (top + BAO_LOG_STACK_CAPACITY - 1) % BAO_LOG_STACK_CAPACITY;
+                entry = ring->entries[top];
+        } while (!atomic_compare_exchange_weak(&ring->state, &state,
+                                               BAO_LOG_STATE(BAO_LOG_VERSION(state) + 1,
+                                                             count - 1, top)));
+
+        bao_log_format(&entry, ring->message);
+        return ring->message;
+#else /* !defined(BAO_LOG) */
+        return "Debugging disabled!";
+#endif /* BAO_LOG */
+}
+
+#ifdef BAO_LOG_DRAIN
+/*
+ * Formats and writes every pending message, oldest first and one per line,
+ * to fd. With threads this covers the rings of all live threads, otherwise
+ * only the caller's. Returns the number of messages drained.
+ */
+BAOLIBDEF size_t bao_log_drain(int fd)
+{
+        size_t drained = 0;
+#ifdef BAO_THREADS
+        struct bao_log_ring_t *ring;
+
+        if (!bao_log_ring.registered)
+                bao_log_register(&bao_log_ring);
+        pthread_mutex_lock(&bao_log_lock);
+        for (ring = bao_log_rings; ring; ring = ring->next)
+                drained += bao_log_drain_ring(ring, fd);
+        pthread_mutex_unlock(&bao_log_lock);
+#else /* !defined(BAO_THREADS) */
+        drained = bao_log_drain_ring(&bao_log_ring, fd);
+#endif /* BAO_THREADS */
+        return drained;
+}
+
+#ifdef BAO_THREADS
+static struct {
+        pthread_t thread;
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        int running;
+        int fd;
+        unsigned interval_ms;
+} bao_log_drainer = { .lock = PTHREAD_MUTEX_INITIALIZER,
+                      .cond = PTHREAD_COND_INITIALIZER };
+
+static void *bao_log_drain_thread(void *arg)
+{
+        struct timespec deadline;
+
+        (void) arg;
+        pthread_mutex_lock(&bao_log_drainer.lock);
+        while (bao_log_drainer.running) {
+                pthread_mutex_unlock(&bao_log_drainer.lock);
+                bao_log_drain(bao_log_drainer.fd);
+                pthread_mutex_lock(&bao_log_drainer.lock);
+
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_sec += bao_log_drainer.interval_ms / 1000;
+                deadline.tv_nsec += (long) (bao_log_drainer.interval_ms % 1000) * 1000000L;
+                if (deadline.tv_nsec >= 1000000000L) {
+                        deadline.tv_sec++;
+                        deadline.tv_nsec -= 1000000000L;
+                }
+                if (bao_log_drainer.running)
+                        pthread_cond_timedwait(&bao_log_drainer.cond,
+                                               &bao_log_drainer.lock, &deadline);
+        }
+        pthread_mutex_unlock(&bao_log_drainer.lock);
+
+        bao_log_drain(bao_log_drainer.fd);
+        return NULL;
+}
+
+/*
+ * Starts a background thread that drains all rings to fd every
+ * interval_ms milliseconds.
+ */
+BAOLIBDEF int bao_log_drain_start(int fd, unsigned interval_ms)
+{
+        int ret = 0;
+
+        pthread_mutex_lock(&bao_log_drainer.lock);
+        if (!bao_log_drainer.running) {
+                bao_log_drainer.fd = fd;
+                bao_log_drainer.interval_ms = interval_ms ? interval_ms : 1;
+                bao_log_drainer.running = 1;
+                ret = -pthread_create(&bao_log_drainer.thread, NULL,
+                                      bao_log_drain_thread, NULL);
+                if (ret != 0)
+                        bao_log_drainer.running = 0;
+        }
+        pthread_mutex_unlock(&bao_log_drainer.lock);
+        return ret;
+}
+
+/*
+ * Stops the background drain after one last pass.
+ */
+BAOLIBDEF void bao_log_drain_stop(void)
+{
+        int running;
+
+        pthread_mutex_lock(&bao_log_drainer.lock);
+        running = bao_log_drainer.running;
+        bao_log_drainer.running = 0;
+        pthread_cond_signal(&bao_log_drainer.cond);
+        pthread_mutex_unlock(&bao_log_drainer.lock);
+        if (running)
+                pthread_join(bao_log_drainer.thread, NULL);
+}
+#endif /* BAO_THREADS */
+#endif /* BAO_LOG_DRAIN */
+
+BAOLIBDEF bao_arena_t bao_arena_create(void)
+{
+        return bao_arena_create2(NULL);
+}
+
+static void bao_arena_policy_init(struct bao_arena_policy_t *dst,
+                                  const struct bao_arena_policy_t *src)
+{
+        if (src) {
+                *dst = *src;
+        } else {
+                memset(dst, 0, sizeof(*dst));
+        }
+        if (!dst->chunk_size)
+                dst->chunk_size = BAO_ARENA_CHUNK_SIZE;
+        if (!dst->max_chunk_size)
+                dst->max_chunk_size = BAO_ARENA_MAX_CHUNK_SIZE;
+        if (!dst->large_size)
+                dst->large_size = BAO_ARENA_LARGE_SIZE;
+        if (!dst->retain_size)
+                dst->retain_size = BAO_ARENA_RETAIN_SIZE;
+        dst->max_chunk_size = BAO_MAX(dst->max_chunk_size, dst->chunk_size);
+}
+
+#ifdef BAO_MMAP
+/*
+ * Maps the arena's reservation and installs it as its oldest chunk. On
+ * failure the arena simply keeps using ordinary chunks.
+ */
+static void bao_arena_map_region(bao_arena_t arena)
+{
+        char *base, *aligned;
+        size_t size, slack = BAO_ARENA_HUGE_PAGE;
+
+        size = ((arena->policy.reserve_size + BAO_ARENA_HUGE_PAGE - 1) /
+                BAO_ARENA_HUGE_PAGE) * BAO_ARENA_HUGE_PAGE;
+#ifdef MAP_NORESERVE
+        base = mmap(NULL, size + slack, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+#else /* !defined(MAP_NORESERVE) */
+        base = mmap(NULL, size + slack, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#endif /* MAP_NORESERVE */
+        if (base == MAP_FAILED) {
+                BAO_LOG_MESSAGE("Failed to reserve %zu bytes!", size);
+                return;
+        }
+
+        /* Trim the mapping down to a huge page aligned range. */
+        aligned = (char *) (((uintptr_t) base + BAO_ARENA_HUGE_PAGE - 1) &
+                            ~(uintptr_t) (BAO_ARENA_HUGE_PAGE - 1));
+        if (aligned != base)
+                munmap(base, aligned - base);
+        if (aligned + size != base + size + slack)
+                munmap(aligned + size, base + size + slack - (aligned + size));
+#ifdef MADV_HUGEPAGE
+        madvise(aligned, size, MADV_HUGEPAGE);
+#endif /* MADV_HUGEPAGE */
+
+        arena->region = (bao_arena_chunk_t) aligned;
+        arena->region_size = size;
+        *arena->region = *arena->first;
+        arena->first->prev = arena->region;
+        arena->first->avail = (char *) ((union bao_header_t *) arena->region + 1);
+        arena->first->limit = aligned + size;
+}
+
+/*
+ * Rewinds the reservation to empty. Its header is all zeroes, so the pages
+ * can be dropped wholesale and come back as zero pages.
+ */
+static void bao_arena_reset_region(bao_arena_t arena)
+{
+        char *start = (char *) arena->region;
+        size_t used, page = (size_t) sysconf(_SC_PAGESIZE);
+
+        assert(arena->first->prev == arena->region);
+        used = arena->first->avail - start;
+        used = ((used + page - 1) / page) * page;
+        if (used > page)
+                madvise(start, used, MADV_DONTNEED);
+        arena->first->avail = (char *) ((union bao_header_t *) arena->region + 1);
+}
+#endif /* BAO_MMAP */
+
+static void *bao_arena_vtable_alloc(void *ctx, size_t size)
+{
+        return bao_arena_alloc(ctx, size);
+}
+
+static void *bao_arena_vtable_realloc(void *ctx, void *p,
+                                      size_t old_size, size_t new_size)
+{
+        void *q;
+        if (p && new_size <= old_size)
+                return p;
+        if ((q = bao_arena_alloc(ctx, new_size)) != NULL && p)
+                memcpy(q, p, old_size);
+        return q;
+}
+
+static void bao_arena_vtable_free(void *ctx, void *p, size_t size)
+{
+        (void) ctx, (void) p, (void) size;
+}
+
+/*
+ * Creates an arena whose chunks come from allocator.
+ */
+BAOLIBDEF bao_arena_t bao_arena_create2(bao_allocator_t allocator)
+{
+        return bao_arena_create_policy(NULL, allocator);
+}
+
+BAOLIBDEF bao_arena_t bao_arena_create_policy(const struct bao_arena_policy_t *policy,
+                                              bao_allocator_t allocator)
+{
+        bao_arena_t arena = bao_alloc(allocator, sizeof(*arena));
+        if (!arena) {
                 BAO_LOG_MESSAGE("Ran out of memory!");
                 return NULL;
         }
 
-        array->size = 0;
-        array->memb_size = memb_size;
-        array->capacity = bao_npo2(size);
+        bao_arena_policy_init(&arena->policy, policy);
 
-        array->data = BAO_MALLOC(array->memb_size * array->capacity);
-        if (!array->data) {
+        arena->bao_arena_freechunks = NULL;
+        arena->bao_arena_nfree = 0;
+        arena->bao_arena_freebytes = 0;
+        arena->large = NULL;
+        arena->next_chunk_size = arena->policy.chunk_size;
+        arena->allocator = allocator;
+        arena->chunkpool = NULL;
+        arena->region = NULL;
+        arena->region_size = 0;
+        arena->vtable.alloc = bao_arena_vtable_alloc;
+        arena->vtable.realloc = bao_arena_vtable_realloc;
+        arena->vtable.free = bao_arena_vtable_free;
+        arena->vtable.ctx = arena;
+        arena->first = bao_alloc(allocator, sizeof(*arena->first));
+        if (!arena->first) {
+                BAO_LOG_MESSAGE("Ran out of memory!");
+                BAO_DEALLOC(allocator, arena, sizeof(*arena));
+                return NULL;
+        }
+
+        arena->first->prev = NULL;
+        arena->first->limit = arena->first->avail = NULL;
+#ifdef BAO_MMAP
+        if (arena->policy.reserve_size)
+                bao_arena_map_region(arena);
+#endif /* BAO_MMAP */
+        return arena;
+}
+
+/*
+ * Returns an allocator that allocates from arena. Its free does nothing and
+ * its realloc copies into a fresh block, so the memory is only given back
+ * by bao_arena_free or bao_arena_release.
+ */
+BAOLIBDEF bao_allocator_t bao_arena_allocator(bao_arena_t arena)
+{
+        assert(arena);
+        return &arena->vtable;
+}
+
+static void *bao_arena_alloc_large(bao_arena_t arena, size_t size)
+{
+        struct bao_arena_large_t *block;
+        size_t m = sizeof(union bao_header_t) + size;
+
+        block = bao_alloc(arena->allocator, m);
+        if (!block) {
                 BAO_LOG_MESSAGE("Ran out of memory!");
-                BAO_FREE(array);
                 return NULL;
         }
 
-        memset(array->data, 0, array->capacity * array->memb_size);
-        return array;
+        block->size = m;
+        block->next = arena->large;
+        arena->large = block;
+        return (union bao_header_t *) block + 1;
+}
+
+/*
+ * Unlinks the first chunk on list with room for size bytes.
+ */
+static bao_arena_chunk_t bao_arena_unlink_free(bao_arena_chunk_t *list, size_t size)
+{
+        bao_arena_chunk_t *pp, chunk;
+
+        for (pp = list; *pp; pp = &(*pp)->prev) {
+                chunk = *pp;
+                char *start = (char *) ((union bao_header_t *) chunk + 1);
+                if (chunk->limit >= start && size <= (size_t) (chunk->limit - start)) {
+                        *pp = chunk->prev;
+                        return chunk;
+                }
+        }
+
+        return NULL;
+}
+
+static bao_arena_chunk_t bao_arena_take_free(bao_arena_t arena, size_t size)
+{
+        bao_arena_chunk_t chunk;
+
+        chunk = bao_arena_unlink_free(&arena->bao_arena_freechunks, size);
+        if (chunk) {
+                arena->bao_arena_nfree--;
+                arena->bao_arena_freebytes -= chunk->limit - (char *) chunk;
+                return chunk;
+        }
+
+#ifdef BAO_THREADS
+        if (arena->chunkpool) {
+                pthread_mutex_lock(&arena->chunkpool->lock);
+                chunk = bao_arena_unlink_free(&arena->chunkpool->chunks, size);
+                if (chunk)
+                        arena->chunkpool->bytes -= chunk->limit - (char *) chunk;
+                pthread_mutex_unlock(&arena->chunkpool->lock);
+        }
+#endif /* BAO_THREADS */
+        return chunk;
+}
+
+BAOLIBDEF void *bao_arena_alloc(bao_arena_t arena, size_t size)
+{
+        assert(arena);
+        assert(size > 0);
+        size = ((size + sizeof(union bao_align_t) - 1) /
+                (sizeof(union bao_align_t))) * (sizeof(union bao_align_t));
+        bao_arena_chunk_t first = arena->first;
+        while (size > first->limit - first->avail) {
+                char *limit;
+                bao_arena_chunk_t new_arena_chunk;
+                if (size >= arena->policy.large_size) {
+                        return bao_arena_alloc_large(arena, size);
+                }
+
+                if ((new_arena_chunk = bao_arena_take_free(arena, size)) != NULL) {
+                        limit = new_arena_chunk->limit;
+                } else {
+                        size_t m = BAO_MAX(arena->next_chunk_size,
+                                           sizeof(union bao_header_t) + size);
+                        new_arena_chunk = bao_alloc(arena->allocator, m);
+                        if (new_arena_chunk == NULL) {
+                                BAO_LOG_MESSAGE("Ran out of memory!");
+                                return NULL;
+                        }
+                        limit = (char *) new_arena_chunk + m;
+                        arena->next_chunk_size = BAO_MIN(arena->next_chunk_size << 1,
+                                                         arena->policy.max_chunk_size);
+                }
+                *new_arena_chunk = *first;
+                first->avail = (char *)((union bao_header_t *) new_arena_chunk + 1);
+                first->limit = limit;
+                first->prev  = new_arena_chunk;
+        }
+        first->avail += size;
+        return first->avail - size;
+}
+
+BAOLIBDEF void *bao_arena_calloc(bao_arena_t arena, size_t nmemb, size_t size)
+{
+        void *ptr;
+
+        assert(size > 0);
+        assert(nmemb > 0);
+
+        ptr = bao_arena_alloc(arena, nmemb * size);
+        if (!ptr) {
+                return NULL;
+        }
+
+        memset(ptr, '\0', nmemb * size);
+        return ptr;
+}
+
+/*
+ * Gives back the newest chunk and makes the one before it current again.
+ */
+static void bao_arena_pop_chunk(bao_arena_t arena)
+{
+        bao_arena_chunk_t first = arena->first;
+        struct bao_arena_chunk_t tmp = *first->prev;
+        size_t m = first->limit - (char *) first->prev;
+#ifdef BAO_THREADS
+        bao_chunkpool_t pool = arena->chunkpool;
+        if (pool) {
+                first->prev->limit = first->limit;
+                pthread_mutex_lock(&pool->lock);
+                if (pool->bytes + m <= pool->policy.retain_size) {
+                        first->prev->prev = pool->chunks;
+                        pool->chunks = first->prev;
+                        pool->bytes += m;
+                        first->prev = NULL;
+                }
+                pthread_mutex_unlock(&pool->lock);
+                if (first->prev) {
+                        BAO_DEALLOC(arena->allocator, first->prev, m);
+                }
+                *first = tmp;
+                return;
+        }
+#endif /* BAO_THREADS */
+        if (arena->bao_arena_freebytes + m <= arena->policy.retain_size) {
+                first->prev->prev = arena->bao_arena_freechunks;
+                arena->bao_arena_freechunks = first->prev;
+                arena->bao_arena_nfree++;
+                arena->bao_arena_freebytes += m;
+                arena->bao_arena_freechunks->limit = first->limit;
+        } else {
+                BAO_DEALLOC(arena->allocator, first->prev, m);
+        }
+        *first = tmp;
+}
+
+static void bao_arena_free_large(bao_arena_t arena, struct bao_arena_large_t *until)
+{
+        struct bao_arena_large_t *block;
+        while ((block = arena->large) != until) {
+                arena->large = block->next;
+                bao_dealloc(arena->allocator, block, block->size);
+        }
+}
+
+BAOLIBDEF void bao_arena_free(bao_arena_t arena)
+{
+        assert(arena);
+        bao_arena_chunk_t first = arena->first;
+        while (first->prev && first->prev != arena->region) {
+                bao_arena_pop_chunk(arena);
+        }
+
+        bao_arena_free_large(arena, NULL);
+
+#ifdef BAO_MMAP
+        if (arena->region) {
+                bao_arena_reset_region(arena);
+                return;
+        }
+#endif /* BAO_MMAP */
+        assert(first->limit == NULL);
+        assert(first->avail == NULL);
+}
+
+BAOLIBDEF void bao_arena_mark(bao_arena_t arena, struct bao_arena_mark_t *mark)
+{
+        assert(arena);
+        assert(mark);
+        mark->chunk = arena->first->prev;
+        mark->avail = arena->first->avail;
+        mark->large = arena->large;
+}
+
+BAOLIBDEF void bao_arena_rewind(bao_arena_t arena,
+                                const struct bao_arena_mark_t *mark)
+{
+        assert(arena);
+        assert(mark);
+        while (arena->first->prev != mark->chunk) {
+                assert(arena->first->prev);
+                assert(arena->first->prev != arena->region);
+                bao_arena_pop_chunk(arena);
+        }
+
+        arena->first->avail = mark->avail;
+        bao_arena_free_large(arena, mark->large);
+}
+
+BAOLIBDEF void bao_arena_release(bao_arena_t *arena)
+{
+        bao_arena_chunk_t chunk;
+        bao_allocator_t allocator;
+
+        assert(arena && *arena);
+        allocator = (*arena)->allocator;
+        bao_arena_free(*arena);
+        while ((chunk = (*arena)->bao_arena_freechunks) != NULL) {
+                (*arena)->bao_arena_freechunks = chunk->prev;
+                bao_dealloc(allocator, chunk, chunk->limit - (char *) chunk);
+        }
+#ifdef BAO_MMAP
+        if ((*arena)->region)
+                munmap((*arena)->region, (*arena)->region_size);
+#endif /* BAO_MMAP */
+        BAO_DEALLOC(allocator, (*arena)->first, sizeof(*(*arena)->first));
+        BAO_DEALLOC(allocator, *arena, sizeof(**arena));
+}
+
+#ifdef BAO_THREADS
+static void bao_chunkpool_destroy_arena(void *arena)
+{
+        bao_arena_t a = arena;
+        bao_arena_release(&a);
+}
+
+BAOLIBDEF bao_chunkpool_t bao_chunkpool_create(const struct bao_arena_policy_t *policy,
+                                               bao_allocator_t allocator)
+{
+        bao_chunkpool_t pool;
+
+        pool = bao_alloc(allocator, sizeof(*pool));
+        if (!pool) {
+                BAO_LOG_MESSAGE("Ran out of memory!");
+                return NULL;
+        }
+
+        if (pthread_mutex_init(&pool->lock, NULL) != 0) {
+                BAO_LOG_MESSAGE("Failed to create the chunk pool lock!");
+                BAO_DEALLOC(allocator, pool, sizeof(*pool));
+                return NULL;
+        }
+
+        if (pthread_key_create(&pool->key, bao_chunkpool_destroy_arena) != 0) {
+                BAO_LOG_MESSAGE("Failed to create the chunk pool key!");
+                pthread_mutex_destroy(&pool->lock);
+                BAO_DEALLOC(allocator, pool, sizeof(*pool));
+                return NULL;
+        }
+
+        bao_arena_policy_init(&pool->policy, policy);
+        pool->chunks = NULL;
+        pool->bytes = 0;
+        pool->allocator = allocator;
+        return pool;
+}
+
+/*
+ * Returns the calling thread's arena for pool, creating it on first use. It
+ * is released, and its chunks handed back to the pool, when the thread
+ * exits.
+ */
+BAOLIBDEF bao_arena_t bao_chunkpool_arena(bao_chunkpool_t pool)
+{
+        bao_arena_t arena;
+
+        assert(pool);
+        if ((arena = pthread_getspecific(pool->key)) != NULL)
+                return arena;
+
+        arena = bao_arena_create_policy(&pool->policy, pool->allocator);
+        if (!arena)
+                return NULL;
+
+        arena->chunkpool = pool;
+        if (pthread_setspecific(pool->key, arena) != 0) {
+                BAO_LOG_MESSAGE("Failed to set the thread's arena!");
+                bao_arena_release(&arena);
+                return NULL;
+        }
+
+        return arena;
+}
+
+/*
+ * Releases the pool and the calling thread's arena. Arenas of other
+ * threads that are still running are not reachable from here, so those
+ * threads must have exited first.
+ */
+BAOLIBDEF void bao_chunkpool_release(bao_chunkpool_t *pool)
+{
+        bao_arena_t arena;
+        bao_arena_chunk_t chunk;
+        bao_allocator_t allocator;
+
+        assert(pool && *pool);
+        if ((arena = pthread_getspecific((*pool)->key)) != NULL) {
+                pthread_setspecific((*pool)->key, NULL);
+                bao_arena_release(&arena);
+        }
+
+        pthread_key_delete((*pool)->key);
+        pthread_mutex_destroy(&(*pool)->lock);
+        allocator = (*pool)->allocator;
+        while ((chunk = (*pool)->chunks) != NULL) {
+                (*pool)->chunks = chunk->prev;
+                bao_dealloc(allocator, chunk, chunk->limit - (char *) chunk);
+        }
+        BAO_DEALLOC(allocator, *pool, sizeof(**pool));
+}
+
+BAOLIBDEF bao_carena_t bao_carena_create(const struct bao_arena_policy_t *policy,
+                                         bao_allocator_t allocator)
+{
+        bao_carena_t arena;
+
+        arena = bao_alloc(allocator, sizeof(*arena));
+        if (!arena) {
+                BAO_LOG_MESSAGE("Ran out of memory!");
+                return NULL;
+        }
+
+        if (pthread_mutex_init(&arena->lock, NULL) != 0) {
+                BAO_LOG_MESSAGE("Failed to create the arena lock!");
+                BAO_DEALLOC(allocator, arena, sizeof(*arena));
+                return NULL;
+        }
+
+        atomic_init(&arena->current, NULL);
+        arena->freechunks = NULL;
+        arena->freebytes = 0;
+        arena->large = NULL;
+        bao_arena_policy_init(&arena->policy, policy);
+        arena->next_chunk_size = arena->policy.chunk_size;
+        arena->allocator = allocator;
+        return arena;
+}
+
+static void *bao_carena_alloc_large(bao_carena_t arena, size_t size)
+{
+        struct bao_arena_large_t *block;
+        size_t m = sizeof(union bao_header_t) + size;
+
+        block = bao_alloc(arena->allocator, m);
+        if (!block) {
+                BAO_LOG_MESSAGE("Ran out of memory!");
+                return NULL;
+        }
+
+        block->size = m;
+        block->next = arena->large;
+        arena->large = block;
+        return (union bao_header_t *) block + 1;
+}
+
+/*
+ * Slow path of bao_carena_alloc, called with the lock held once chunk has
+ * run out. Installs a chunk with room for size bytes unless another thread
+ * already replaced chunk.
+ */
+static int bao_carena_refill(bao_carena_t arena, struct bao_carena_chunk_t *chunk,
+                             size_t size)
+{
+        struct bao_carena_chunk_t **pp, *new_chunk = NULL;
+        size_t m;
+
+        if (atomic_load_explicit(&arena->current, memory_order_relaxed) != chunk)
+                return 0;
+
+        for (pp = &arena->freechunks; *pp; pp = &(*pp)->prev) {
+                if ((*pp)->size >= size) {
+                        new_chunk = *pp;
+                        *pp = new_chunk->prev;
+                        arena->freebytes -= sizeof(union bao_carena_header_t) + new_chunk->size;
+                        break;
+                }
+        }
+
+        if (!new_chunk) {
+                m = BAO_MAX(arena->next_chunk_size,
+                            sizeof(union bao_carena_header_t) + size);
+                new_chunk = bao_alloc(arena->allocator, m);
+                if (!new_chunk) {
+                        BAO_LOG_MESSAGE("Ran out of memory!");
+                        return -ENOMEM;
+                }
+                new_chunk->size = m - sizeof(union bao_carena_header_t);
+                arena->next_chunk_size = BAO_MIN(arena->next_chunk_size << 1,
+                                                 arena->policy.max_chunk_size);
+        }
+
+        new_chunk->prev = chunk;
+        atomic_store_explicit(&new_chunk->used, 0, memory_order_relaxed);
+        atomic_store_explicit(&arena->current, new_chunk, memory_order_release);
+        return 0;
+}
+
+BAOLIBDEF void *bao_carena_alloc(bao_carena_t arena, size_t size)
+{
+        struct bao_carena_chunk_t *chunk;
+        size_t offset;
+        void *p;
+        int ret;
+
+        assert(arena);
+        assert(size > 0);
+        size = ((size + sizeof(union bao_align_t) - 1) /
+                (sizeof(union bao_align_t))) * (sizeof(union bao_align_t));
+
+        if (size >= arena->policy.large_size) {
+                pthread_mutex_lock(&arena->lock);
+                p = bao_carena_alloc_large(arena, size);
+                pthread_mutex_unlock(&arena->lock);
+                return p;
+        }
+
+        for (;;) {
+                chunk = atomic_load_explicit(&arena->current, memory_order_acquire);
+                if (chunk) {
+                        offset = atomic_fetch_add_explicit(&chunk->used, size,
+                                                           memory_order_relaxed);
+                        if (offset <= chunk->size && size <= chunk->size - offset)
+                                return (char *) ((union bao_carena_header_t *) chunk + 1) + offset;
+                }
+
+                pthread_mutex_lock(&arena->lock);
+                ret = bao_carena_refill(arena, chunk, size);
+                pthread_mutex_unlock(&arena->lock);
+                if (ret != 0)
+                        return NULL;
+        }
+}
+
+BAOLIBDEF void *bao_carena_calloc(bao_carena_t arena, size_t nmemb, size_t size)
+{
+        void *ptr;
+
+        assert(size > 0);
+        assert(nmemb > 0);
+
+        ptr = bao_carena_alloc(arena, nmemb * size);
+        if (!ptr) {
+                return NULL;
+        }
+
+        memset(ptr, '\0', nmemb * size);
+        return ptr;
+}
+
+BAOLIBDEF void bao_carena_free(bao_carena_t arena)
+{
+        struct bao_carena_chunk_t *chunk, *prev;
+        struct bao_arena_large_t *block;
+        size_t m;
+
+        assert(arena);
+        chunk = atomic_load_explicit(&arena->current, memory_order_acquire);
+        for (; chunk; chunk = prev) {
+                prev = chunk->prev;
+                m = sizeof(union bao_carena_header_t) + chunk->size;
+                if (arena->freebytes + m <= arena->policy.retain_size) {
+                        chunk->prev = arena->freechunks;
+                        arena->freechunks = chunk;
+                        arena->freebytes += m;
+                } else {
+                        bao_dealloc(arena->allocator, chunk, m);
+                }
+        }
+        atomic_store_explicit(&arena->current, NULL, memory_order_release);
+
+        while ((block = arena->large) != NULL) {
+                arena->large = block->next;
+                bao_dealloc(arena->allocator, block, block->size);
+        }
+}
+
+BAOLIBDEF void bao_carena_release(bao_carena_t *arena)
+{
+        struct bao_carena_chunk_t *chunk;
+        bao_allocator_t allocator;
+
+        assert(arena && *arena);
+        allocator = (*arena)->allocator;
+        bao_carena_free(*arena);
+        while ((chunk = (*arena)->freechunks) != NULL) {
+                (*arena)->freechunks = chunk->prev;
+                bao_dealloc(allocator, chunk,
+                            sizeof(union bao_carena_header_t) + chunk->size);
+        }
+        pthread_mutex_destroy(&(*arena)->lock);
+        BAO_DEALLOC(allocator, *arena, sizeof(**arena));
+}
+
+static _Thread_local struct bao_worker_t *bao_worker_self;
+
+static int bao_deque_push(struct bao_deque_t *deque, struct bao_task_t *task)
+{
+        long b, t;
+
+        b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+        t = atomic_load_explicit(&deque->top, memory_order_acquire);
+        if (b - t >= BAO_DEQUE_SIZE)
+                return -ENOMEM;
+
+        atomic_store_explicit(&deque->tasks[b & (BAO_DEQUE_SIZE - 1)], task,
+                              memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+        return 0;
+}
+
+static struct bao_task_t *bao_deque_take(struct bao_deque_t *deque)
+{
+        struct bao_task_t *task = NULL;
+        long b, t;
+
+        b = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+        atomic_store_explicit(&deque->bottom, b, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        t = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+        if (t <= b) {
+                task = atomic_load_explicit(&deque->tasks[b & (BAO_DEQUE_SIZE - 1)],
+                                            memory_order_relaxed);
+                if (t == b) {
+                        /* Last task: race the thieves for it. */
+                        if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1,
+                                                                     memory_order_seq_cst,
+                                                                     memory_order_relaxed))
+                                task = NULL;
+                        atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+                }
+        } else {
+                atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+        }
+
+        return task;
+}
+
+static struct bao_task_t *bao_deque_steal(struct bao_deque_t *deque)
+{
+        struct bao_task_t *task = NULL;
+        long b, t;
+
+        t = atomic_load_explicit(&deque->top, memory_order_acquire);
+        atomic_thread_fence(memory_order_seq_cst);
+        b = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+
+        if (t < b) {
+                task = atomic_load_explicit(&deque->tasks[t & (BAO_DEQUE_SIZE - 1)],
+                                            memory_order_relaxed);
+                if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1,
+                                                             memory_order_seq_cst,
+                                                             memory_order_relaxed))
+                        return NULL;
+        }
+
+        return task;
+}
+
+static struct bao_worker_t *bao_threadpool_self(bao_threadpool_t pool)
+{
+        return bao_worker_self && bao_worker_self->pool == pool ? bao_worker_self : NULL;
+}
+
+static void bao_task_finish(bao_threadpool_t pool, struct bao_task_t *task)
+{
+        _Atomic size_t *pending = task->pending;
+
+        BAO_FREE(task);
+        if (atomic_fetch_sub(pending, 1) == 1) {
+                pthread_mutex_lock(&pool->lock);
+                pthread_cond_broadcast(&pool->done);
+                if (atomic_load(&pool->sleepers) > 0)
+                        pthread_cond_broadcast(&pool->work);
+                pthread_mutex_unlock(&pool->lock);
+        }
+}
+
+/*
+ * Queues task on the calling worker's deque, or on the injection queue
+ * for threads outside the pool. A worker whose deque is full runs the
+ * task itself.
+ */
+static void bao_threadpool_push(bao_threadpool_t pool, struct bao_task_t *task)
+{
+        struct bao_worker_t *self = bao_threadpool_self(pool);
+
+        if (self) {
+                if (bao_deque_push(&self->deque, task) != 0) {
+                        task->run(task);
+                        bao_task_finish(pool, task);
+                        return;
+                }
+        } else {
+                task->next = NULL;
+                pthread_mutex_lock(&pool->inject_lock);
+                if (pool->inject_tail)
+                        pool->inject_tail->next = task;
+                else
+                        pool->inject_head = task;
+                pool->inject_tail = task;
+                atomic_fetch_add(&pool->injected, 1);
+                pthread_mutex_unlock(&pool->inject_lock);
+        }
+
+        atomic_fetch_add(&pool->queued, 1);
+        if (atomic_load(&pool->sleepers) > 0) {
+                pthread_mutex_lock(&pool->lock);
+                pthread_cond_signal(&pool->work);
+                pthread_mutex_unlock(&pool->lock);
+        }
+}
+
+static struct bao_task_t *bao_threadpool_find(bao_threadpool_t pool,
+                                              struct bao_worker_t *self)
+{
+        struct bao_task_t *task;
+        size_t i, start;
+
+        if ((task = bao_deque_take(&self->deque)) != NULL)
+                goto found;
+
+        if (atomic_load(&pool->injected) != 0) {
+                pthread_mutex_lock(&pool->inject_lock);
+                if ((task = pool->inject_head) != NULL) {
+                        pool->inject_head = task->next;
+                        if (!pool->inject_head)
+                                pool->inject_tail = NULL;
+                        atomic_fetch_sub(&pool->injected, 1);
+                }
+                pthread_mutex_unlock(&pool->inject_lock);
+                if (task)
+                        goto found;
+        }
+
+        self->seed ^= self->seed << 13;
+        self->seed ^= self->seed >> 17;
+        self->seed ^= self->seed << 5;
+        start = self->seed % pool->nworkers;
+        for (i = 0; i < pool->nworkers; i++) {
+                if (pool->workers + (start + i) % pool->nworkers == self)
+                        continue;
+                task = bao_deque_steal(&pool->workers[(start + i) % pool->nworkers].deque);
+                if (task)
+                        goto found;
+        }
+
+        return NULL;
+
+found:
+        atomic_fetch_sub(&pool->queued, 1);
+        return task;
+}
+
+/*
+ * Runs tasks on the calling worker until *pending drops to zero. When
+ * there is nothing left to run or steal it sleeps like an idle worker, so
+ * it is woken both for new work and for the count reaching zero.
+ */
+static void bao_threadpool_help(bao_threadpool_t pool, struct bao_worker_t *self,
+                                _Atomic size_t *pending)
+{
+        struct bao_task_t *task;
+
+        while (atomic_load(pending) != 0) {
+                if ((task = bao_threadpool_find(pool, self)) != NULL) {
+                        task->run(task);
+                        bao_task_finish(pool, task);
+                        continue;
+                }
+
+                pthread_mutex_lock(&pool->lock);
+                atomic_fetch_add(&pool->sleepers, 1);
+                if (atomic_load(pending) != 0 && atomic_load(&pool->queued) == 0)
+                        pthread_cond_wait(&pool->work, &pool->lock);
+                atomic_fetch_sub(&pool->sleepers, 1);
+                pthread_mutex_unlock(&pool->lock);
+        }
+}
+
+/*
+ * Blocks the calling thread until *pending drops to zero. Workers keep
+ * running tasks meanwhile, so nested waits cannot starve the pool.
+ */
+static void bao_threadpool_join(bao_threadpool_t pool, _Atomic size_t *pending)
+{
+        struct bao_worker_t *self = bao_threadpool_self(pool);
+
+        if (self) {
+                bao_threadpool_help(pool, self, pending);
+                return;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        while (atomic_load(pending) != 0)
+                pthread_cond_wait(&pool->done, &pool->lock);
+        pthread_mutex_unlock(&pool->lock);
+}
+
+static void *bao_threadpool_main(void *arg)
+{
+        struct bao_worker_t *self = arg;
+        bao_threadpool_t pool = self->pool;
+        struct bao_task_t *task;
+
+        bao_worker_self = self;
+        while (!atomic_load(&pool->stop)) {
+                if ((task = bao_threadpool_find(pool, self)) != NULL) {
+                        task->run(task);
+                        bao_task_finish(pool, task);
+                        continue;
+                }
+
+                pthread_mutex_lock(&pool->lock);
+                atomic_fetch_add(&pool->sleepers, 1);
+                while (!atomic_load(&pool->stop) && atomic_load(&pool->queued) == 0)
+                        pthread_cond_wait(&pool->work, &pool->lock);
+                atomic_fetch_sub(&pool->sleepers, 1);
+                pthread_mutex_unlock(&pool->lock);
+        }
+
+        bao_worker_self = NULL;
+        return NULL;
+}
+
+/*
+ * Creates a pool of nthreads workers, or one per online CPU when nthreads
+ * is 0.
+ */
+BAOLIBDEF bao_threadpool_t bao_threadpool_create(size_t nthreads)
+{
+        bao_threadpool_t pool;
+        size_t i;
+#ifdef _SC_NPROCESSORS_ONLN
+        long ncpu;
+#endif /* _SC_NPROCESSORS_ONLN */
+
+        if (nthreads == 0) {
+                nthreads = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+                if ((ncpu = sysconf(_SC_NPROCESSORS_ONLN)) > 0)
+                        nthreads = (size_t) ncpu;
+#endif /* _SC_NPROCESSORS_ONLN */
+        }
+
+        pool = BAO_MALLOC(sizeof(*pool));
+        if (!pool) {
+                BAO_LOG_MESSAGE("Ran out of memory!");
+                return NULL;
+        }
+
+        pool->workers = BAO_CALLOC(nthreads, sizeof(*pool->workers));
+        if (!pool->workers) {
+                BAO_LOG_MESSAGE("Ran out of memory!");
+                BAO_FREE(pool);
+                return NULL;
+        }
+
+        pool->nworkers = 0;
+        pthread_mutex_init(&pool->lock, NULL);
+        pthread_cond_init(&pool->work, NULL);
+        pthread_cond_init(&pool->done, NULL);
+        atomic_init(&pool->sleepers, 0);
+        atomic_init(&pool->stop, 0);
+        atomic_init(&pool->queued, 0);
+        atomic_init(&pool->pending, 0);
+        pthread_mutex_init(&pool->inject_lock, NULL);
+        atomic_init(&pool->injected, 0);
+        pool->inject_head = pool->inject_tail = NULL;
+
+        for (i = 0; i < nthreads; i++) {
+                pool->workers[i].pool = pool;
+                pool->workers[i].index = i;
+                pool->workers[i].seed = (uint32_t) i * 2654435761u + 1;
+                atomic_init(&pool->workers[i].deque.top, 0);
+                atomic_init(&pool->workers[i].deque.bottom, 0);
+        }
+
+        /* Workers steal from each other, so all of them exist before any starts. */
+        pool->nworkers = nthreads;
+        for (i = 0; i < nthreads; i++) {
+                if (pthread_create(&pool->workers[i].thread, NULL,
+                                   bao_threadpool_main, &pool->workers[i]) != 0) {
+                        BAO_LOG_MESSAGE("Could not start worker thread!");
+                        atomic_store(&pool->stop, 1);
+                        pthread_mutex_lock(&pool->lock);
+                        pthread_cond_broadcast(&pool->work);
+                        pthread_mutex_unlock(&pool->lock);
+                        while (i-- > 0)
+                                pthread_join(pool->workers[i].thread, NULL);
+                        BAO_FREE(pool->workers);
+                        BAO_FREE(pool);
+                        return NULL;
+                }
+        }
+
+        return pool;
+}
+
+BAOLIBDEF size_t bao_threadpool_size(bao_threadpool_t pool)
+{
+        assert(pool);
+        return pool->nworkers;
+}
+
+/*
+ * Returns the index of the calling worker in [0, bao_threadpool_size), or
+ * bao_threadpool_size for threads outside the pool.
+ */
+BAOLIBDEF size_t bao_threadpool_worker(bao_threadpool_t pool)
+{
+        struct bao_worker_t *self;
+        assert(pool);
+
+        self = bao_threadpool_self(pool);
+        return self ? self->index : pool->nworkers;
+}
+
+static void bao_threadpool_run_fn(struct bao_task_t *task)
+{
+        task->fn(task->arg);
+}
+
+/*
+ * Queues fn(arg) to run on the pool. bao_threadpool_wait waits for every
+ * task submitted this way.
+ */
+BAOLIBDEF int bao_threadpool_submit(bao_threadpool_t pool, void (*fn)(void *),
+                                    void *arg)
+{
+        struct bao_task_t *task;
+        assert(pool);
+        assert(fn);
+
+        task = BAO_MALLOC(sizeof(*task));
+        if (!task) {
+                BAO_LOG_MESSAGE("Ran out of memory!");
+                return -ENOMEM;
+        }
+
+        task->run = bao_threadpool_run_fn;
+        task->fn = fn;
+        task->arg = arg;
+        task->pending = &pool->pending;
+        atomic_fetch_add(&pool->pending, 1);
+        bao_threadpool_push(pool, task);
+        return 0;
+}
+
+/*
+ * Blocks until every task queued with bao_threadpool_submit has finished.
+ * It must not be called from a task running on pool: that task is still
+ * counted as pending, so the wait would never end. Tasks that need to
+ * wait for nested work should use bao_threadpool_for instead.
+ */
+BAOLIBDEF void bao_threadpool_wait(bao_threadpool_t pool)
+{
+        assert(pool);
+        assert(!bao_threadpool_self(pool));
+        bao_threadpool_join(pool, &pool->pending);
+}
+
+struct bao_threadpool_for_t {
+        bao_threadpool_t pool;
+        void (*body)(size_t, size_t, void *);
+        void *arg;
+        size_t grain;
+        _Atomic size_t pending;
+};
+
+/*
+ * Runs a range of a parallel for, splitting off the upper half as a new
+ * task until the range is no longer than the grain size.
+ */
+static void bao_threadpool_run_range(struct bao_task_t *task)
+{
+        struct bao_threadpool_for_t *pfor = task->arg;
+        struct bao_task_t *half;
+        size_t lo = task->lo, hi = task->hi, mid;
+
+        while (hi - lo > pfor->grain) {
+                half = BAO_MALLOC(sizeof(*half));
+                if (!half)
+                        break;
+
+                mid = lo + (hi - lo) / 2;
+                half->run = bao_threadpool_run_range;
+                half->arg = pfor;
+                half->lo = mid;
+                half->hi = hi;
+                half->pending = &pfor->pending;
+                atomic_fetch_add(&pfor->pending, 1);
+                bao_threadpool_push(pfor->pool, half);
+                hi = mid;
+        }
+
+        pfor->body(lo, hi, pfor->arg);
+}
+
+/*
+ * Calls body(lo, hi, arg) over disjoint subranges covering [begin, end),
+ * none longer than grain, and returns once all of them have run.
+ */
+BAOLIBDEF int bao_threadpool_for(bao_threadpool_t pool, size_t begin, size_t end,
+                                 size_t grain, void (*body)(size_t, size_t, void *),
+                                 void *arg)
+{
+        struct bao_threadpool_for_t pfor;
+        struct bao_task_t *task;
+        assert(pool);
+        assert(body);
+
+        if (begin >= end)
+                return 0;
+
+        task = BAO_MALLOC(sizeof(*task));
+        if (!task) {
+                BAO_LOG_MESSAGE("Ran out of memory!");
+                return -ENOMEM;
+        }
+
+        pfor.pool = pool;
+        pfor.body = body;
+        pfor.arg = arg;
+        pfor.grain = BAO_MAX(grain, 1);
+        atomic_init(&pfor.pending, 1);
+
+        task->run = bao_threadpool_run_range;
+        task->arg = &pfor;
+        task->lo = begin;
+        task->hi = end;
+        task->pending = &pfor.pending;
+        bao_threadpool_push(pool, task);
+        bao_threadpool_join(pool, &pfor.pending);
+        return 0;
+}
+
+/*
+ * Waits for submitted tasks, then stops and joins the workers.
+ */
+BAOLIBDEF void bao_threadpool_release(bao_threadpool_t *pool)
+{
+        size_t i;
+        assert(pool && *pool);
+
+        bao_threadpool_wait(*pool);
+        atomic_store(&(*pool)->stop, 1);
+        pthread_mutex_lock(&(*pool)->lock);
+        pthread_cond_broadcast(&(*pool)->work);
+        pthread_mutex_unlock(&(*pool)->lock);
+        for (i = 0; i < (*pool)->nworkers; i++)
+                pthread_join((*pool)->workers[i].thread, NULL);
+
+        pthread_mutex_destroy(&(*pool)->lock);
+        pthread_cond_destroy(&(*pool)->work);
+        pthread_cond_destroy(&(*pool)->done);
+        pthread_mutex_destroy(&(*pool)->inject_lock);
+        BAO_FREE((*pool)->workers);
+        BAO_FREE(*pool);
+}
+
+/*
+ * State shared by the parallel apply functions.
+ */
+struct bao_apply_parallel_t {
+        bao_threadpool_t pool;
+        void *container;
+        void (*apply)(void *, void *);
+        void (*apply_pair)(void *, void *, void *);
+        void *ctx;
+        size_t ctx_size;
+};
+
+static void *bao_apply_parallel_ctx(struct bao_apply_parallel_t *p)
+{
+        if (!p->ctx_size)
+                return p->ctx;
+        return (char *) p->ctx + bao_threadpool_worker(p->pool) * p->ctx_size;
+}
+#endif /* BAO_THREADS */
+
+BAOLIBDEF bao_pool_t bao_pool_create(size_t memb_size, size_t count,
+                                    bao_arena_t arena)
+{
+        bao_pool_t pool;
+
+        assert(memb_size > 0);
+
+        pool = BAO_MALLOC(sizeof(*pool));
+        if (!pool) {
+                BAO_LOG_MESSAGE("Ran out of memory!");
+                return NULL;
+        }
+
+        memb_size = BAO_MAX(memb_size, sizeof(void *));
+        pool->memb_size = ((memb_size + sizeof(union bao_align_t) - 1) /
+                           (sizeof(union bao_align_t))) * (sizeof(union bao_align_t));
+        pool->count = count ? count : BAO_POOL_CHUNK;
+        pool->arena = arena;
+        pool->chunks = NULL;
+        pool->freelist = NULL;
+        pool->avail = pool->limit = NULL;
+        return pool;
+}
+
+BAOLIBDEF void *bao_pool_alloc(bao_pool_t pool)
+{
+        void *p;
+        char *chunk;
+        size_t m;
+
+        assert(pool);
+
+        if ((p = pool->freelist) != NULL) {
+                pool->freelist = *(void **) p;
+                return p;
+        }
+
+        if (pool->avail == pool->limit) {
+                m = pool->memb_size * pool->count;
+                if (pool->arena) {
+                        chunk = bao_arena_alloc(pool->arena, m);
+                        if (!chunk) return NULL;
+                        pool->avail = chunk;
+                } else {
+                        /* Malloc'd chunks are chained through their first word. */
+                        m += sizeof(union bao_align_t);
+                        chunk = BAO_MALLOC(m);
+                        if (!chunk) {
+                                BAO_LOG_MESSAGE("Ran out of memory!");
+                                return NULL;
+                        }
+                        *(void **) chunk = pool->chunks;
+                        pool->chunks = chunk;
+                        pool->avail = chunk + sizeof(union bao_align_t);
+                }
+                pool->limit = chunk + m;
+        }
+
+        p = pool->avail;
+        pool->avail += pool->memb_size;
+        return p;
+}
+
+BAOLIBDEF void bao_pool_put(bao_pool_t pool, void *p)
+{
+        assert(pool);
+        if (!p) return;
+        *(void **) p = pool->freelist;
+        pool->freelist = p;
+}
+
+BAOLIBDEF void bao_pool_free(bao_pool_t pool)
+{
+        void *chunk, *next;
+
+        assert(pool);
+        for (chunk = pool->chunks; chunk; chunk = next) {
+                next = *(void **) chunk;
+                BAO_FREE(chunk);
+        }
+
+        pool->chunks = NULL;
+        pool->freelist = NULL;
+        pool->avail = pool->limit = NULL;
+}
+
+BAOLIBDEF void bao_pool_release(bao_pool_t *pool)
+{
+        assert(pool && *pool);
+        bao_pool_free(*pool);
+        BAO_FREE(*pool);
+}
+
+BAOLIBDEF bao_array_t bao_array_create(size_t size, size_t memb_size)
+{
+        return bao_array_create2(size, memb_size, NULL);
+}
+
+static bao_array_t bao_array_create_flags(size_t size, size_t memb_size,
+                                         bao_allocator_t allocator,
+                                         unsigned flags)
+{
+        bao_array_t array;
+        assert(memb_size > 0);
+
+        array = bao_alloc(allocator, sizeof(*array));
+        if (!array) {
+                BAO_LOG_MESSAGE("Ran out of memory!");
+                return NULL;
+        }
+
+        array->size = 0;
+        array->memb_size = memb_size;
+        array->capacity = bao_npo2(size);
+        array->allocator = allocator;
+        array->flags = flags;
+        array->inline_capacity = 0;
+
+        array->data = bao_alloc(allocator, array->memb_size * array->capacity);
+        if (!array->data) {
+                BAO_LOG_MESSAGE("Ran out of memory!");
+                BAO_DEALLOC(allocator, array, sizeof(*array));
+                return NULL;
+        }
+
+        if (!(flags & BAO_ARRAY_NO_ZERO))
+                memset(array->data, 0, array->capacity * array->memb_size);
+        return array;
+}
+
+BAOLIBDEF bao_array_t bao_array_create2(size_t size, size_t memb_size,
+                                        bao_allocator_t allocator)
+{
+        return bao_array_create_flags(size, memb_size, allocator, 0);
+}
+
+/*
+ * Creates an array that never zeroes its storage, for arrays that are
+ * refilled in full after every clear.
+ */
+BAOLIBDEF bao_array_t bao_array_create_raw(size_t size, size_t memb_size,
+                                           bao_allocator_t allocator)
+{
+        return bao_array_create_flags(size, memb_size, allocator,
+                                      BAO_ARRAY_NO_ZERO);
+}
+
+static size_t bao_array_inline_offset(void)
+{
+        return (sizeof(struct bao_array_t) + sizeof(union bao_align_t) - 1) /
+                sizeof(union bao_align_t) * sizeof(union bao_align_t);
+}
+
+/*
+ * Creates an array with room for capacity elements in the same allocation
+ * as its header. It only allocates again once it outgrows them.
+ */
+BAOLIBDEF bao_array_t bao_array_create_small(size_t capacity, size_t memb_size,
+                                             bao_allocator_t allocator)
+{
+        bao_array_t array;
+        assert(memb_size > 0);
+
+        capacity = BAO_MAX(capacity, 1);
+        array = bao_alloc(allocator, bao_array_inline_offset() + capacity * memb_size);
+        if (!array) {
+                BAO_LOG_MESSAGE("Ran out of memory!");
+                return NULL;
+        }
+
+        bao_array_init(array, (char *) array + bao_array_inline_offset(),
+                       capacity, memb_size, allocator);
+        array->inline_capacity = capacity;
+        return array;
+}
+
+/*
+ * Sets up a caller-owned header over buf, which holds capacity elements
+ * and must outlive the array. Release it with bao_array_fini.
+ */
+BAOLIBDEF void bao_array_init(bao_array_t array, void *buf, size_t capacity,
+                              size_t memb_size, bao_allocator_t allocator)
+{
+        assert(array);
+        assert(buf);
+        assert(capacity > 0);
+        assert(memb_size > 0);
+
+        array->size = 0;
+        array->memb_size = memb_size;
+        array->capacity = capacity;
+        array->data = buf;
+        array->allocator = allocator;
+        array->flags = BAO_ARRAY_BORROWED;
+        array->inline_capacity = 0;
+        memset(buf, 0, capacity * memb_size);
+}
+
+BAOLIBDEF size_t bao_array_size(bao_array_t array)
+{
+        assert(array);
+        return array->size;
+}
+
+BAOLIBDEF size_t bao_array_capacity(bao_array_t array)
+{
+        assert(array);
+        return array->capacity;
+}
+
+BAOLIBDEF int bao_array_empty(bao_array_t array)
+{
+        assert(array);
+        return array->size == 0;
+}
+
+#ifdef BAO_MREMAP
+static size_t bao_array_map_size(size_t size)
+{
+        size_t page = (size_t) sysconf(_SC_PAGESIZE);
+        return (size + page - 1) & ~(page - 1);
+}
+
+/*
+ * Moves the array's storage into a mapping, or resizes the mapping it is
+ * already in. Fresh pages come zeroed, so only the tail of the last old
+ * page may need clearing.
+ */
+static int bao_array_remap(bao_array_t array, size_t capacity)
+{
+        size_t old_size = array->capacity * array->memb_size;
+        size_t new_size = capacity * array->memb_size;
+        void *new_data;
+
+        if (array->flags & BAO_ARRAY_MAPPED) {
+                new_data = mremap(array->data, bao_array_map_size(old_size),
+                                  bao_array_map_size(new_size), MREMAP_MAYMOVE);
+                if (new_data != MAP_FAILED && new_size > old_size
+                    && !(array->flags & BAO_ARRAY_NO_ZERO))
+                        memset((char *) new_data + old_size, 0,
+                               BAO_MIN(new_size, bao_array_map_size(old_size)) - old_size);
+        } else {
+                new_data = mmap(NULL, bao_array_map_size(new_size),
+                                PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                                -1, 0);
+                if (new_data != MAP_FAILED) {
+                        memcpy(new_data, array->data, BAO_MIN(old_size, new_size));
+                        bao_dealloc(NULL, array->data, old_size);
+                }
+        }
+
+        if (new_data == MAP_FAILED) {
+                BAO_LOG_MESSAGE("Ran out of memory!");
+                return -ENOMEM;
+        }
+
+        array->data = new_data;
+        array->capacity = capacity;
+        array->flags |= BAO_ARRAY_MAPPED;
+        return 0;
+}
+#endif /* BAO_MREMAP */
+
+/*
+ * Reallocates the array to exactly capacity elements, zeroing any new ones.
+ */
+static int bao_array_realloc(bao_array_t array, size_t capacity)
+{
+        void *new_data;
+
+        if (array->flags & BAO_ARRAY_BORROWED) {
+                if (capacity <= array->capacity)
+                        return 0;
+                new_data = bao_alloc(array->allocator, capacity * array->memb_size);
+                if (!new_data) {
+                        BAO_LOG_MESSAGE("Ran out of memory!");
+                        return -ENOMEM;
+                }
+                memcpy(new_data, array->data, array->capacity * array->memb_size);
+                array->flags &= ~BAO_ARRAY_BORROWED;
+                goto done;
+        }
+
+#ifdef BAO_MREMAP
+        if (!array->allocator
+            && ((array->flags & BAO_ARRAY_MAPPED)
+                || capacity * array->memb_size >= BAO_ARRAY_MMAP_THRESHOLD))
+                return bao_array_remap(array, capacity);
+#endif /* BAO_MREMAP */
+
+        new_data = bao_realloc(array->allocator, array->data,
+                               array->capacity * array->memb_size,
+                               capacity * array->memb_size);
+        if (!new_data) {
+                BAO_LOG_MESSAGE("Ran out of memory!");
+                return -ENOMEM;
+        }
+
+done:
+        array->data = new_data;
+        if (capacity > array->capacity && !(array->flags & BAO_ARRAY_NO_ZERO))
+                memset(((char *) array->data) + array->memb_size * array->capacity,
+                       0, array->memb_size * (capacity - array->capacity));
+        array->capacity = capacity;
+        return 0;
+}
+
+/*
+ * Grows the array to at least min_capacity elements, at least doubling
+ * the current capacity. Shared by bao_array_t and BAO_ARRAY_DEFINE.
+ */
+BAOLIBDEF int bao_array_grow(bao_array_t array, size_t min_capacity)
+{
+        assert(array);
+        if (min_capacity <= array->capacity)
+                return 0;
+        return bao_array_realloc(array, bao_npo2(BAO_MAX(min_capacity,
+                                                         array->capacity << 1)));
+}
+
+BAOLIBDEF int bao_array_reserve(bao_array_t array, size_t capacity)
+{
+        assert(array);
+        if (capacity <= array->capacity)
+                return 0;
+        return bao_array_realloc(array, capacity);
+}
+
+/*
+ * Sets the number of elements. New elements are zeroed, unless the array
+ * has BAO_ARRAY_NO_ZERO set, in which case they are left uninitialized.
+ */
+BAOLIBDEF int bao_array_resize(bao_array_t array, size_t size)
+{
+        int ret;
+        assert(array);
+
+        if (size > array->capacity) {
+                if ((ret = bao_array_grow(array, size)) != 0) {
+                        return ret;
+                }
+        }
+
+        if (size > array->size && !(array->flags & BAO_ARRAY_NO_ZERO))
+                memset(((char *) array->data) + array->memb_size * array->size,
+                       0, array->memb_size * (size - array->size));
+        array->size = size;
+        return 0;
+}
+
+BAOLIBDEF int bao_array_shrink_to_fit(bao_array_t array)
+{
+        assert(array);
+        if (array->capacity == BAO_MAX(array->size, 1))
+                return 0;
+        return bao_array_realloc(array, BAO_MAX(array->size, 1));
+}
+
+BAOLIBDEF int bao_array_insert(bao_array_t array, void *v)
+{
+        int ret;
+        assert(array);
+        assert(v);
+
+        if (array->size == array->capacity) {
+                if ((ret = bao_array_grow(array, array->capacity + 1)) != 0) {
+                        return ret;
+                }
+        }
+
+        memcpy(((char *) array->data) + array->memb_size * array->size,
+               v, array->memb_size);
+        array->size++;
+        return 0;
+}
+
+BAOLIBDEF int bao_array_insert2(bao_array_t array, void *vs, const size_t count)
+{
+        int ret;
+        assert(array);
+        assert(vs);
+        assert(count > 0);
+
+        if ((ret = bao_array_grow(array, array->size + count)) != 0) {
+                return ret;
+        }
+
+        memcpy(((char *) array->data) + array->memb_size * array->size,
+               vs, array->memb_size * count);
+        array->size += count;
+        return 0;
+}
+
+BAOLIBDEF int bao_array_insert_at(bao_array_t array, void *v, size_t index)
+{
+        assert(array);
+        assert(v);
+        assert(index >= 0 && index < bao_array_size(array));
+
+        memcpy(((char *) array->data) + array->memb_size * index,
+               v, array->memb_size);
+        return 0;
+}
+
+/*
+ * Inserts count elements from vs before index, shifting the tail up.
+ */
+BAOLIBDEF int bao_array_insert_range(bao_array_t array, size_t index,
+                                     const void *vs, size_t count)
+{
+        char *data;
+        int ret;
+        assert(array);
+        assert(vs || count == 0);
+        assert(index <= array->size);
+
+        if ((ret = bao_array_grow(array, array->size + count)) != 0) {
+                return ret;
+        }
+
+        data = array->data;
+        memmove(data + array->memb_size * (index + count),
+                data + array->memb_size * index,
+                array->memb_size * (array->size - index));
+        memcpy(data + array->memb_size * index, vs, array->memb_size * count);
+        array->size += count;
+        return 0;
+}
+
+/*
+ * Removes count elements starting at index, keeping the order of the rest.
+ */
+BAOLIBDEF void bao_array_erase(bao_array_t array, size_t index, size_t count)
+{
+        char *data;
+        assert(array);
+        assert(index <= array->size && count <= array->size - index);
+
+        data = array->data;
+        memmove(data + array->memb_size * index,
+                data + array->memb_size * (index + count),
+                array->memb_size * (array->size - index - count));
+        array->size -= count;
+}
+
+/*
+ * Removes the element at index by moving the last element into its place.
+ */
+BAOLIBDEF void bao_array_swap_remove(bao_array_t array, size_t index)
+{
+        char *data;
+        assert(array);
+        assert(index < array->size);
+
+        data = array->data;
+        array->size--;
+        if (index != array->size)
+                memcpy(data + array->memb_size * index,
+                       data + array->memb_size * array->size, array->memb_size);
+}
+
+BAOLIBDEF void bao_array_apply(bao_array_t array, void (*apply)(void *))
+{
+        size_t i;
+        void *elem;
+        assert(array);
+        assert(apply);
+
+        for (i = 0; i < array->size; i++) {
+                elem = ((char *) array->data) + i * array->memb_size;
+                apply(elem);
+        }
+}
+
+#ifdef BAO_THREADS
+static void bao_array_apply_range(size_t lo, size_t hi, void *arg)
+{
+        struct bao_apply_parallel_t *p = arg;
+        bao_array_t array = p->container;
+        void *ctx = bao_apply_parallel_ctx(p);
+        size_t i;
+
+        for (i = lo; i < hi; i++)
+                p->apply(((char *) array->data) + i * array->memb_size, ctx);
+}
+
+/*
+ * Calls apply(elem, ctx) on every element from the workers of pool, grain
+ * elements per task. The array must not change until it returns.
+ *
+ * With ctx_size 0, every call gets ctx itself, so calls running on
+ * different workers race on anything they write through it. Otherwise ctx
+ * must point to bao_threadpool_size(pool) slots of ctx_size bytes, one per
+ * worker, and each call gets the slot of the worker running it; the caller
+ * reduces the slots once this returns.
+ */
+BAOLIBDEF int bao_array_apply_parallel(bao_array_t array, bao_threadpool_t pool,
+                                       size_t grain, void (*apply)(void *, void *),
+                                       void *ctx, size_t ctx_size)
+{
+        struct bao_apply_parallel_t p;
+        assert(array);
+        assert(pool);
+        assert(apply);
+
+        p.pool = pool;
+        p.container = array;
+        p.apply = apply;
+        p.ctx = ctx;
+        p.ctx_size = ctx_size;
+        return bao_threadpool_for(pool, 0, array->size, grain,
+                                  bao_array_apply_range, &p);
+}
+#endif /* BAO_THREADS */
+
+BAOLIBDEF void *bao_array_pop(bao_array_t array)
+{
+        assert(array);
+        void *v;
+        if (bao_array_empty(array)) {
+                return NULL;
+        }
+
+        v = bao_array_get(array, array->size-1);
+        array->size--;
+        return v;
+}
+
+BAOLIBDEF void *bao_array_get(bao_array_t array, size_t i)
+{
+        assert(array);
+        assert(i >= 0 && i < bao_array_capacity(array));
+        return ((char *) array->data) + i * array->memb_size;
+}
+
+BAOLIBDEF void bao_array_clear(bao_array_t array)
+{
+        assert(array);
+        array->size = 0;
+        if (!(array->flags & BAO_ARRAY_NO_ZERO))
+                memset(array->data, 0, array->capacity * array->memb_size);
+}
+
+/*
+ * Empties the array without touching its storage.
+ */
+BAOLIBDEF void bao_array_reset(bao_array_t array)
+{
+        assert(array);
+        array->size = 0;
+}
+
+BAOLIBDEF void *bao_array_find(bao_array_t array, void *v,
+                               int (*compare)(void *, void *))
+{
+        size_t i;
+        void *elem;
+        assert(array);
+        assert(compare);
+        assert(v);
+
+        for (i = 0; i < array->size; i++) {
+                elem = ((char *) array->data) + i * array->memb_size;
+                if (compare(elem, v) == 0) return elem;
+        }
+
+        return NULL;
+}
+
+#ifdef BAO_SSE2
+/*
+ * Reduces a mask with one bit per byte that compared equal to one with a
+ * bit at the first byte of every element whose bytes all compared equal.
+ */
+static unsigned bao_find_reduce(unsigned mask, size_t size)
+{
+        mask &= mask >> 1;
+        mask &= mask >> 2;
+        if (size == 4)
+                return mask & 0x11111111u;
+        mask &= mask >> 4;
+        if (size == 8)
+                return mask & 0x01010101u;
+        mask &= mask >> 8;
+        return mask & 0x00010001u;
+}
+#endif /* BAO_SSE2 */
+
+/*
+ * Scans n elements of size bytes for v, starting at element i. Returns the
+ * index of the first match, or n when count is set, in which case every
+ * match is added to *count.
+ */
+static size_t bao_find_scalar(const char *data, size_t i, size_t n,
+                              const void *v, size_t size, size_t *count)
+{
+        for (; i < n; i++) {
+                if (memcmp(data + i * size, v, size) == 0) {
+                        if (!count)
+                                return i;
+                        (*count)++;
+                }
+        }
+
+        return n;
+}
+
+#ifdef BAO_SSE2
+static size_t bao_find_sse2(const char *data, size_t n, const void *v,
+                            size_t size, size_t *count)
+{
+        __m128i key, block;
+        unsigned mask;
+        int32_t k32;
+        int64_t k64;
+        size_t i, step = 16 / size;
+
+        if (size == 4) {
+                memcpy(&k32, v, 4);
+                key = _mm_set1_epi32(k32);
+        } else if (size == 8) {
+                memcpy(&k64, v, 8);
+                key = _mm_set1_epi64x(k64);
+        } else {
+                key = _mm_loadu_si128((const __m128i *) v);
+        }
+
+        for (i = 0; i + step <= n; i += step) {
+                block = _mm_loadu_si128((const __m128i *) (data + i * size));
+                mask = bao_find_reduce((unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(block, key)),
+                                       size);
+                if (!mask)
+                        continue;
+                if (!count)
+                        return i + bao_ctz(mask) / size;
+                *count += bao_popcount(mask);
+        }
+
+        return bao_find_scalar(data, i, n, v, size, count);
+}
+#endif /* BAO_SSE2 */
+
+#ifdef BAO_AVX2_DISPATCH
+__attribute__((target("avx2")))
+static size_t bao_find_avx2(const char *data, size_t n, const void *v,
+                            size_t size, size_t *count)
+{
+        __m256i key, block;
+        unsigned mask;
+        int32_t k32;
+        int64_t k64;
+        size_t i, step = 32 / size;
+
+        if (size == 4) {
+                memcpy(&k32, v, 4);
+                key = _mm256_set1_epi32(k32);
+        } else if (size == 8) {
+                memcpy(&k64, v, 8);
+                key = _mm256_set1_epi64x(k64);
+        } else {
+                key = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) v));
+        }
+
+        for (i = 0; i + step <= n; i += step) {
+                block = _mm256_loadu_si256((const __m256i *) (data + i * size));
+                mask = bao_find_reduce((unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, key)),
+                                       size);
+                if (!mask)
+                        continue;
+                if (!count)
+                        return i + bao_ctz(mask) / size;
+                *count += bao_popcount(mask);
+        }
+
+        return bao_find_scalar(data, i, n, v, size, count);
+}
+#endif /* BAO_AVX2_DISPATCH */
+
+/*
+ * Picks the widest available scan for 4, 8 and 16 byte elements, chosen
+ * at run time between AVX2 and SSE2 where the compiler allows it.
+ */
+static size_t bao_find_dispatch(bao_array_t array, const void *v, size_t *count)
+{
+        size_t size = array->memb_size;
+
+        if (size == 4 || size == 8 || size == 16) {
+#ifdef BAO_AVX2_DISPATCH
+                if (__builtin_cpu_supports("avx2"))
+                        return bao_find_avx2(array->data, array->size, v, size, count);
+#endif /* BAO_AVX2_DISPATCH */
+#ifdef BAO_SSE2
+                return bao_find_sse2(array->data, array->size, v, size, count);
+#endif /* BAO_SSE2 */
+        }
+
+        return bao_find_scalar(array->data, 0, array->size, v, size, count);
+}
+
+/*
+ * Returns the index of the first element whose bytes equal the memb_size
+ * bytes at v, or BAO_ARRAY_NOT_FOUND.
+ */
+BAOLIBDEF size_t bao_array_find_bytes(bao_array_t array, const void *v)
+{
+        size_t i;
+        assert(array);
+        assert(v);
+
+        i = bao_find_dispatch(array, v, NULL);
+        return i < array->size ? i : BAO_ARRAY_NOT_FOUND;
+}
+
+/*
+ * Returns the number of elements whose bytes equal the memb_size bytes at v.
+ */
+BAOLIBDEF size_t bao_array_count_bytes(bao_array_t array, const void *v)
+{
+        size_t count = 0;
+        assert(array);
+        assert(v);
+
+        bao_find_dispatch(array, v, &count);
+        return count;
+}
+
+#define BAO_SORT_INSERTION (16)
+
+/*
+ * Swaps two elements. The common element sizes are moved as whole words
+ * instead of going through a variable-length copy.
+ */
+static void bao_sort_swap(char *a, char *b, size_t size)
+{
+        uint64_t t64[2];
+        uint32_t t32;
+        unsigned char t8;
+
+        switch (size) {
+        case 4:
+                memcpy(&t32, a, 4);
+                memcpy(a, b, 4);
+                memcpy(b, &t32, 4);
+                return;
+        case 8:
+                memcpy(t64, a, 8);
+                memcpy(a, b, 8);
+                memcpy(b, t64, 8);
+                return;
+        case 16:
+                memcpy(t64, a, 16);
+                memcpy(a, b, 16);
+                memcpy(b, t64, 16);
+                return;
+        }
+
+        for (; size >= 8; size -= 8, a += 8, b += 8) {
+                memcpy(t64, a, 8);
+                memcpy(a, b, 8);
+                memcpy(b, t64, 8);
+        }
+        for (; size > 0; size--, a++, b++) {
+                t8 = *a;
+                *a = *b;
+                *b = t8;
+        }
+}
+
+static void bao_sort_insertion(char *base, size_t n, size_t size,
+                               int (*compare)(void *, void *))
+{
+        char *p, *q, *end = base + n * size;
+
+        for (p = base + size; p < end; p += size)
+                for (q = p; q > base && compare(q - size, q) > 0; q -= size)
+                        bao_sort_swap(q - size, q, size);
+}
+
+static void bao_sort_sift(char *base, size_t root, size_t n, size_t size,
+                          int (*compare)(void *, void *))
+{
+        size_t child;
+
+        while ((child = 2 * root + 1) < n) {
+                if (child + 1 < n && compare(base + child * size,
+                                             base + (child + 1) * size) < 0)
+                        child++;
+                if (compare(base + root * size, base + child * size) >= 0)
+                        return;
+                bao_sort_swap(base + root * size, base + child * size, size);
+                root = child;
+        }
+}
+
+static void bao_sort_heap(char *base, size_t n, size_t size,
+                          int (*compare)(void *, void *))
+{
+        size_t i;
+
+        for (i = n / 2; i-- > 0;)
+                bao_sort_sift(base, i, n, size, compare);
+        for (i = n; i-- > 1;) {
+                bao_sort_swap(base, base + i * size, size);
+                bao_sort_sift(base, 0, i, size, compare);
+        }
+}
+
+/*
+ * Quicksort on a median-of-three pivot that recurses into the smaller
+ * side, falls back to heapsort once depth runs out and leaves short
+ * ranges to insertion sort.
+ */
+static void bao_sort_intro(char *base, size_t n, size_t size,
+                           int (*compare)(void *, void *), size_t depth)
+{
+        char *mid, *last, *i, *j;
+        size_t left;
+
+        while (n > BAO_SORT_INSERTION) {
+                if (depth-- == 0) {
+                        bao_sort_heap(base, n, size, compare);
+                        return;
+                }
+
+                mid = base + (n / 2) * size;
+                last = base + (n - 1) * size;
+                if (compare(mid, base) < 0)
+                        bao_sort_swap(mid, base, size);
+                if (compare(last, mid) < 0) {
+                        bao_sort_swap(last, mid, size);
+                        if (compare(mid, base) < 0)
+                                bao_sort_swap(mid, base, size);
+                }
+                bao_sort_swap(base, mid, size);
+
+                /* The pivot sits at base and last is no smaller than it. */
+                i = base;
+                j = base + n * size;
+                for (;;) {
+                        do i += size; while (compare(i, base) < 0);
+                        do j -= size; while (compare(j, base) > 0);
+                        if (i >= j)
+                                break;
+                        bao_sort_swap(i, j, size);
+                }
+                bao_sort_swap(base, j, size);
+
+                left = (size_t) (j - base) / size;
+                if (left < n - left - 1) {
+                        bao_sort_intro(base, left, size, compare, depth);
+                        base = j + size;
+                        n -= left + 1;
+                } else {
+                        bao_sort_intro(j + size, n - left - 1, size, compare, depth);
+                        n = left;
+                }
+        }
+
+        bao_sort_insertion(base, n, size, compare);
+}
+
+BAOLIBDEF void bao_array_sort(bao_array_t array, int (*compare)(void *, void *))
+{
+        size_t depth = 0, n;
+        assert(array);
+        assert(compare);
+
+        for (n = array->size; n > 1; n >>= 1)
+                depth += 2;
+        bao_sort_intro(array->data, array->size, array->memb_size, compare, depth);
+}
+
+/*
+ * Maps a key to an unsigned integer with the same ordering.
+ */
+static uint64_t bao_radix_key(const char *elem, int key)
+{
+        uint32_t u32;
+        uint64_t u64;
+
+        switch (key) {
+        case BAO_ARRAY_KEY_U32:
+                memcpy(&u32, elem, 4);
+                return u32;
+        case BAO_ARRAY_KEY_I32:
+                memcpy(&u32, elem, 4);
+                return u32 ^ UINT32_C(0x80000000);
+        case BAO_ARRAY_KEY_F32:
+                memcpy(&u32, elem, 4);
+                return (u32 & UINT32_C(0x80000000)) ? (uint32_t) ~u32
+                        : u32 | UINT32_C(0x80000000);
+        case BAO_ARRAY_KEY_U64:
+                memcpy(&u64, elem, 8);
+                return u64;
+        case BAO_ARRAY_KEY_I64:
+                memcpy(&u64, elem, 8);
+                return u64 ^ UINT64_C(0x8000000000000000);
+        default:
+                memcpy(&u64, elem, 8);
+                return (u64 & UINT64_C(0x8000000000000000)) ? ~u64
+                        : u64 | UINT64_C(0x8000000000000000);
+        }
+}
+
+/*
+ * Stable LSD radix sort on the key at offset, one byte per pass. Passes
+ * where every element has the same byte are skipped.
+ */
+BAOLIBDEF int bao_array_radix_sort(bao_array_t array, int key, size_t offset)
+{
+        size_t (*counts)[256], n, i, pass, passes, sum, c, memb_size;
+        char *src, *dst, *tmp, *buf;
+        uint64_t k;
+        assert(array);
+        assert(key >= BAO_ARRAY_KEY_U32 && key <= BAO_ARRAY_KEY_F64);
+
+        passes = key <= BAO_ARRAY_KEY_F32 ? 4 : 8;
+        memb_size = array->memb_size;
+        assert(offset + passes <= memb_size);
+
+        n = array->size;
+        if (n < 2)
+                return 0;
+
+        counts = bao_calloc(array->allocator, passes, sizeof(*counts));
+        buf = bao_alloc(array->allocator, n * memb_size);
+        if (!counts || !buf) {
+                BAO_LOG_MESSAGE("Ran out of memory!");
+                if (counts) bao_dealloc(array->allocator, counts, passes * sizeof(*counts));
+                if (buf) bao_dealloc(array->allocator, buf, n * memb_size);
+                return -ENOMEM;
+        }
+
+        src = array->data;
+        for (i = 0; i < n; i++) {
+                k = bao_radix_key(src + i * memb_size + offset, key);
+                for (pass = 0; pass < passes; pass++)
+                        counts[pass][(k >> (8 * pass)) & 0xff]++;
+        }
+
+        dst = buf;
+        for (pass = 0; pass < passes; pass++) {
+                k = bao_radix_key(src + offset, key);
+                if (counts[pass][(k >> (8 * pass)) & 0xff] == n)
+                        continue;
+
+                for (i = 0, sum = 0; i < 256; i++) {
+                        c = counts[pass][i];
+                        counts[pass][i] = sum;
+                        sum += c;
+                }
+                for (i = 0; i < n; i++) {
+                        k = bao_radix_key(src + i * memb_size + offset, key);
+                        memcpy(dst + counts[pass][(k >> (8 * pass)) & 0xff]++ * memb_size,
+                               src + i * memb_size, memb_size);
+                }
+
+                tmp = src;
+                src = dst;
+                dst = tmp;
+        }
+
+        if (src != array->data)
+                memcpy(array->data, src, n * memb_size);
+        bao_dealloc(array->allocator, counts, passes * sizeof(*counts));
+        bao_dealloc(array->allocator, buf, n * memb_size);
+        return 0;
+}
+
+/*
+ * Returns the index of the first element of a sorted array that does not
+ * compare below v.
+ */
+BAOLIBDEF size_t bao_array_lower_bound(bao_array_t array, void *v,
+                                       int (*compare)(void *, void *))
+{
+        size_t lo = 0, hi, mid;
+        assert(array);
+        assert(compare);
+
+        for (hi = array->size; lo < hi;) {
+                mid = lo + (hi - lo) / 2;
+                if (compare((char *) array->data + mid * array->memb_size, v) < 0)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+
+        return lo;
+}
+
+/*
+ * Returns the index of the first element of a sorted array that compares
+ * above v.
+ */
+BAOLIBDEF size_t bao_array_upper_bound(bao_array_t array, void *v,
+                                       int (*compare)(void *, void *))
+{
+        size_t lo = 0, hi, mid;
+        assert(array);
+        assert(compare);
+
+        for (hi = array->size; lo < hi;) {
+                mid = lo + (hi - lo) / 2;
+                if (compare((char *) array->data + mid * array->memb_size, v) <= 0)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+
+        return lo;
+}
+
+BAOLIBDEF void *bao_array_bsearch(bao_array_t array, void *v,
+                                  int (*compare)(void *, void *))
+{
+        size_t i;
+        void *elem;
+
+        i = bao_array_lower_bound(array, v, compare);
+        if (i == array->size)
+                return NULL;
+        elem = (char *) array->data + i * array->memb_size;
+        return compare(elem, v) == 0 ? elem : NULL;
+}
+
+/*
+ * Releases the data of an array set up with bao_array_init.
+ */
+BAOLIBDEF void bao_array_fini(bao_array_t array)
+{
+        assert(array);
+        if (array->flags & BAO_ARRAY_BORROWED) {
+                array->data = NULL;
+                return;
+        }
+#ifdef BAO_MREMAP
+        if (array->flags & BAO_ARRAY_MAPPED) {
+                munmap(array->data, bao_array_map_size(array->capacity *
+                                                       array->memb_size));
+                array->data = NULL;
+                return;
+        }
+#endif /* BAO_MREMAP */
+        BAO_DEALLOC(array->allocator, array->data,
+                    array->capacity * array->memb_size);
+}
+
+BAOLIBDEF void bao_array_free(bao_array_t *array)
+{
+        size_t size;
+        assert(array && *array);
+
+        size = sizeof(**array);
+        if ((*array)->inline_capacity)
+                size = bao_array_inline_offset() +
+                        (*array)->inline_capacity * (*array)->memb_size;
+        bao_array_fini(*array);
+        BAO_DEALLOC((*array)->allocator, *array, size);
+}
+
+BAOLIBDEF bao_list_t bao_list_create(void *v)
+{
+        return bao_list_create2(v, NULL);
+}
+
+BAOLIBDEF bao_list_t bao_list_create2(void *v, bao_allocator_t allocator)
+{
+        bao_list_t list;
+
+        assert(v);
+
+        list = bao_alloc(allocator, sizeof(*list));
+        if (!list) {
+                BAO_LOG_MESSAGE("Ran out of memory!");
+                return NULL;
+        }
+
+        list->data = v;
+        list->rest = NULL;
+        return list;
+}
+
+BAOLIBDEF bao_list_t bao_list_push(bao_list_t list, void *v)
+{
+        return bao_list_push2(list, v, NULL);
+}
+
+/*
+ * The *2 list functions take their nodes from allocator. Nodes do not
+ * remember where they came from, so a list must be popped and freed with
+ * the allocator it was built with.
+ */
+BAOLIBDEF bao_list_t bao_list_push2(bao_list_t list, void *v,
+                                    bao_allocator_t allocator)
+{
+        bao_list_t rest;
+        assert(v);
+
+        rest = bao_list_create2(v, allocator);
+        if (!rest) {
+                BAO_LOG_MESSAGE("Ran out of memory!");
+                return list;
+        }
+
+        rest->data = v;
+        rest->rest = list;
+        return rest;
+}
+
+BAOLIBDEF bao_list_t bao_list_pop(bao_list_t list, void **v)
+{
+        return bao_list_pop2(list, v, NULL);
+}
+
+BAOLIBDEF bao_list_t bao_list_pop2(bao_list_t list, void **v,
+                                   bao_allocator_t allocator)
+{
+        bao_list_t head;
+        if (!list) return list;
+
+        head = list->rest;
+        if (v) *v = list->data;
+        BAO_DEALLOC(allocator, list, sizeof(*list));
+        return head;
+}
+
+BAOLIBDEF void *bao_list_get(bao_list_t list, size_t i)
+{
+        size_t j;
+        for (j = 0; j < i && list; j++) {
+                list = list->rest;
+        }
+
+        return list ? list->data : NULL;
+}
+
+BAOLIBDEF bao_list_t bao_list_append(bao_list_t a_list, bao_list_t b_list)
+{
+        bao_list_t *head = &a_list;
+
+        while (*head) {
+                head = &(*head)->rest;
+        }
+        *head = b_list;
+        return a_list;
+}
+
+BAOLIBDEF void bao_list_free(bao_list_t *list)
+{
+        bao_list_free2(list, NULL);
+}
+
+BAOLIBDEF void bao_list_free2(bao_list_t *list, bao_allocator_t allocator)
+{
+        bao_list_t next;
+
+        assert(list);
+        for (; *list; *list = next) {
+                next = (*list)->rest;
+                BAO_DEALLOC(allocator, *list, sizeof(**list));
+        }
+}
+
+/*
+ * The _pool variants take their nodes from pool, which must have been
+ * created with a memb_size of at least sizeof(struct bao_list_t). Lists
+ * built this way are freed all at once with bao_pool_free.
+ */
+BAOLIBDEF bao_list_t bao_list_create_pool(bao_pool_t pool, void *v)
+{
+        bao_list_t list;
+
+        assert(pool);
+        assert(pool->memb_size >= sizeof(*list));
+        assert(v);
+
+        list = bao_pool_alloc(pool);
+        if (!list) {
+                BAO_LOG_MESSAGE("Ran out of memory!");
+                return NULL;
+        }
+
+        list->data = v;
+        list->rest = NULL;
+        return list;
+}
+
+BAOLIBDEF bao_list_t bao_list_push_pool(bao_pool_t pool, bao_list_t list, void *v)
+{
+        bao_list_t rest;
+        assert(v);
+
+        rest = bao_list_create_pool(pool, v);
+        if (!rest) {
+                return list;
+        }
+
+        rest->rest = list;
+        return rest;
+}
+
+BAOLIBDEF bao_list_t bao_list_pop_pool(bao_pool_t pool, bao_list_t list, void **v)
+{
+        bao_list_t head;
+        assert(pool);
+        if (!list) return list;
+
+        head = list->rest;
+        if (v) *v = list->data;
+        bao_pool_put(pool, list);
+        return head;
+}
+
+static const size_t bao_primes[] = {
+        509, 509, 1021, 2053, 4093, 8191, 16381, 32771, 65521,
+        131071, 262139, 524287, 1048573, 2097143, 4194301, 8388593,
+        16777213, 33554393, 67108859, 134217689, 268435399, 536870909,
+        1073741789, 2147483647, SIZE_MAX
+};
+
+#define BAO_NPRIMES (sizeof(bao_primes) / sizeof(bao_primes[0]) - 1)
+
+/*
+ * Returns the bucket count a table of the given hint starts with.
+ */
+static size_t bao_hash_initial_size(size_t hint)
+{
+        size_t i;
+        for (i = 1; bao_primes[i] < hint; i++)
+                ;
+        return bao_primes[i-1];
+}
+
+/*
+ * Returns the smallest bucket count in the table that is at least n.
+ */
+static size_t bao_hash_size(size_t n)
+{
+        size_t i;
+        for (i = 1; i < BAO_NPRIMES - 1 && bao_primes[i] < n; i++)
+                ;
+        return bao_primes[i];
+}
+
+/*
+ * The tables grow once the average chain holds more than BAO_HASH_LOAD
+ * entries and shrink once it holds fewer than 1/BAO_HASH_SHRINK. Resizing
+ * is incremental: every insert or remove moves at most
+ * BAO_HASH_REHASH_STEP chains, and skips at most ten times that many empty
+ * buckets, from the old bucket array to the new one. Lookups never move
+ * anything, so concurrent finds on an otherwise unshared table are safe.
+ */
+#define BAO_HASH_LOAD (1)
+#define BAO_HASH_SHRINK (8)
+#define BAO_HASH_REHASH_STEP (4)
+
+/*
+ * Returns the chain an entry with hash h lives on. Old buckets that have
+ * not been moved yet still own their entries.
+ */
+static struct bao_mapping_t **bao_map_bucket(bao_map_t map, size_t h)
+{
+        size_t i;
+        if (map->old_buckets) {
+                i = h % map->old_size;
+                if (i >= map->rehash)
+                        return &map->old_buckets[i];
+        }
+        return &map->buckets[h % map->size];
+}
+
+static void bao_map_rehash_step(bao_map_t map)
+{
+        size_t i, n = BAO_HASH_REHASH_STEP, visits = n * 10;
+        struct bao_mapping_t *p, *q;
+
+        if (!map->old_buckets) return;
+
+        while (n && visits && map->rehash < map->old_size) {
+                p = map->old_buckets[map->rehash];
+                map->old_buckets[map->rehash++] = NULL;
+                visits--;
+                if (!p) continue;
+                for (; p; p = q) {
+                        q = p->next;
+                        i = p->hash % map->size;
+                        p->next = map->buckets[i];
+                        map->buckets[i] = p;
+                }
+                n--;
+        }
+
+        if (map->rehash == map->old_size) {
+                BAO_DEALLOC(map->allocator, map->old_buckets,
+                            map->old_size * sizeof(*map->old_buckets));
+                map->old_size = 0;
+                map->rehash = 0;
+        }
+}
+
+static struct bao_mapping_t *bao_map_node_alloc(bao_map_t map)
+{
+        if (map->pool)
+                return bao_pool_alloc(map->pool);
+        return bao_alloc(map->allocator, sizeof(struct bao_mapping_t));
+}
+
+static void bao_map_node_free(bao_map_t map, struct bao_mapping_t *p)
+{
+        if (map->pool)
+                bao_pool_put(map->pool, p);
+        else
+                bao_dealloc(map->allocator, p, sizeof(*p));
+}
+
+static void bao_map_resize(bao_map_t map)
+{
+        size_t size;
+        struct bao_mapping_t **buckets;
+
+        if (map->old_buckets) return;
+
+        if (map->length > map->size * BAO_HASH_LOAD) {
+                size = bao_hash_size(map->size + 1);
+        } else if (map->length < map->size / BAO_HASH_SHRINK
+                   && map->size > map->min_size) {
+                size = BAO_MAX(bao_hash_size(map->length * 2), map->min_size);
+        } else {
+                return;
+        }
+
+        if (size == map->size) return;
+
+        buckets = bao_calloc(map->allocator, size, sizeof(*buckets));
+        if (!buckets) {
+                /* The chains only get longer, so keep going with the old table. */
+                BAO_LOG_MESSAGE("Ran out of memory!");
+                return;
+        }
+
+        map->old_buckets = map->buckets;
+        map->old_size = map->size;
+        map->rehash = 0;
+        map->buckets = buckets;
+        map->size = size;
+}
+
+BAOLIBDEF bao_map_t bao_map_create(size_t hint,
+                                   int (*compare)(const void *, const void *),
+                                   size_t hash(const void *))
+{
+        return bao_map_create2(hint, compare, hash, NULL);
+}
+
+BAOLIBDEF bao_map_t bao_map_create2(size_t hint,
+                                    int (*compare)(const void *, const void *),
+                                    size_t (*hash)(const void *),
+                                    bao_allocator_t allocator)
+{
+        bao_map_t map;
+
+        assert(compare);
+        assert(hash);
+
+        map = bao_alloc(allocator, sizeof(*map));
+        if (!map) {
+                BAO_LOG_MESSAGE("Ran out of memory!");
+                return NULL;
+        }
+
+        map->allocator = allocator;
+        map->size = map->min_size = bao_hash_initial_size(hint);
+        map->buckets = bao_calloc(allocator, map->size, sizeof(*map->buckets));
+        if (!map->buckets) {
+                BAO_LOG_MESSAGE("Ran out of memory!");
+                BAO_DEALLOC(allocator, map, sizeof(*map));
+                return NULL;
+        }
+
+        map->length = 0;
+        map->compare = compare;
+        map->hash = hash;
+        map->old_buckets = NULL;
+        map->old_size = 0;
+        map->rehash = 0;
+        map->pool = NULL;
+        return map;
+}
+
+/*
+ * Creates a map whose nodes come from a private node pool, backed by arena
+ * when it is not NULL. bao_map_free then drops the pool's chunks instead of
+ * walking every chain; with an arena the memory stays with the arena.
+ */
+BAOLIBDEF bao_map_t bao_map_create_pooled(size_t hint,
+                                          int (*compare)(const void *, const void *),
+                                          size_t (*hash)(const void *),
+                                          bao_arena_t arena)
+{
+        bao_map_t map;
+
+        map = bao_map_create(hint, compare, hash);
+        if (!map) {
+                return NULL;
+        }
+
+        map->pool = bao_pool_create(sizeof(struct bao_mapping_t), 0, arena);
+        if (!map->pool) {
+                bao_map_free(&map);
+                return NULL;
+        }
+
+        return map;
+}
+
+#include <stdio.h>
+static int bao_map_insert_hashed(bao_map_t map, void *key, void *v, size_t h,
+                                 void **prev)
+{
+        struct bao_mapping_t **bucket, *p;
+
+        bucket = bao_map_bucket(map, h);
+        for (p = *bucket; p; p = p->next)
+                if (p->hash == h && map->compare(key, p->key) == 0)
+                        break;
+
+        if (p == NULL) {
+                p = bao_map_node_alloc(map);
+                if (!p) {
+                        BAO_LOG_MESSAGE("Ran out of memory!");
+                        return -ENOMEM;
+                }
+                p->hash = h;
+                p->key = key;
+                p->next = *bucket;
+                *bucket = p;
+                map->length++;
+                if (prev) *prev = NULL;
+                bao_map_resize(map);
+        } else if (prev) {
+                *prev = p->value;
+        }
+
+        p->value = v;
+        return 0;
+}
+
+BAOLIBDEF int bao_map_insert(bao_map_t map, void *key, void *v, void **prev)
+{
+        assert(map);
+        assert(key);
+        assert(v);
+
+        bao_map_rehash_step(map);
+        return bao_map_insert_hashed(map, key, v, map->hash(key), prev);
+}
+
+static int bao_map_remove_hashed(bao_map_t map, const void *key, size_t h,
+                                 void **fkey, void **fv)
+{
+        struct bao_mapping_t **pp;
+
+        for (pp = bao_map_bucket(map, h); *pp; pp = &(*pp)->next) {
+                if ((*pp)->hash == h && map->compare(key, (*pp)->key) == 0) {
+                        struct bao_mapping_t *p = *pp;
+                        void *value = p->value;
+                        void *key = p->key;
+                        *pp = p->next;
+                        bao_map_node_free(map, p);
+                        map->length--;
+                        if (fkey) {
+                                *fkey = key;
+                        }
+
+                        if (fv) {
+                                *fv = value;
+                        }
+                        bao_map_resize(map);
+                        return 0;
+                }
+        }
+
+        return -1;
+}
+
+BAOLIBDEF int bao_map_remove(bao_map_t map, const void *key,
+                             void **fkey, void **fv)
+{
+        assert(map);
+        assert(key);
+        bao_map_rehash_step(map);
+        return bao_map_remove_hashed(map, key, map->hash(key), fkey, fv);
+}
+
+/*
+ * Lookup without a rehash step, so it leaves the map untouched.
+ */
+static void *bao_map_find_hashed(bao_map_t map, const void *key, size_t h)
+{
+        struct bao_mapping_t *p;
+
+        for (p = *bao_map_bucket(map, h); p; p = p->next)
+                if (p->hash == h && map->compare(key, p->key) == 0)
+                        break;
+        return p ? p->value : NULL;
+}
+
+BAOLIBDEF void *bao_map_find(bao_map_t map, void *key)
+{
+        assert(map);
+        assert(key);
+        return bao_map_find_hashed(map, key, map->hash(key));
+}
+
+#define BAO_MAP_BATCH (16)
+
+/*
+ * Looks up n keys, storing each value (or NULL) in values, and returns the
+ * number found. Keys go through in groups of BAO_MAP_BATCH: all bucket
+ * heads of a group are prefetched before any is read, and the chains are
+ * then walked a step at a time across the group so their misses overlap.
+ */
+BAOLIBDEF size_t bao_map_find_batch(bao_map_t map, void **keys, size_t n,
+                                    void **values)
+{
+        struct bao_mapping_t **slots[BAO_MAP_BATCH];
+        struct bao_mapping_t *nodes[BAO_MAP_BATCH];
+        size_t hashes[BAO_MAP_BATCH], live[BAO_MAP_BATCH];
+        size_t base, m, i, j, nlive, found = 0;
+        struct bao_mapping_t *p;
+        assert(map);
+        assert(keys || n == 0);
+        assert(values || n == 0);
+
+        for (base = 0; base < n; base += m) {
+                m = BAO_MIN(n - base, BAO_MAP_BATCH);
+
+                for (i = 0; i < m; i++) {
+                        hashes[i] = map->hash(keys[base + i]);
+                        slots[i] = bao_map_bucket(map, hashes[i]);
+                        BAO_PREFETCH(slots[i]);
+                }
+
+                for (i = 0; i < m; i++) {
+                        nodes[i] = *slots[i];
+                        if (nodes[i])
+                                BAO_PREFETCH(nodes[i]);
+                        values[base + i] = NULL;
+                        live[i] = i;
+                }
+
+                for (nlive = m; nlive > 0;) {
+                        for (i = j = 0; i < nlive; i++) {
+                                size_t k = live[i];
+                                if (!(p = nodes[k]))
+                                        continue;
+                                if (p->hash == hashes[k]
+                                    && map->compare(keys[base + k], p->key) == 0) {
+                                        values[base + k] = p->value;
+                                        found++;
+                                        continue;
+                                }
+                                if ((nodes[k] = p->next) != NULL)
+                                        BAO_PREFETCH(p->next);
+                                live[j++] = k;
+                        }
+                        nlive = j;
+                }
+        }
+
+        return found;
+}
+
+BAOLIBDEF void bao_map_apply(bao_map_t map, void (*apply)(void *, void *, void *),
+                             void *arg)
+{
+        size_t i;
+        struct bao_mapping_t *p;
+        assert(map);
+        assert(apply);
+
+        for (i = map->rehash; i < map->old_size; i++) {
+                for (p = map->old_buckets[i]; p; p = p->next) {
+                        apply(p->key, p->value, arg);
+                }
+        }
+
+        for (i = 0; i < map->size; i++) {
+                for (p = map->buckets[i]; p; p = p->next) {
+                        apply(p->key, p->value, arg);
+                }
+        }
+}
+
+#ifdef BAO_THREADS
+/*
+ * Bucket ranges cover the unmigrated old buckets first, then the new ones.
+ */
+static void bao_map_apply_range(size_t lo, size_t hi, void *arg)
+{
+        struct bao_apply_parallel_t *p = arg;
+        bao_map_t map = p->container;
+        void *ctx = bao_apply_parallel_ctx(p);
+        size_t i, old = map->old_size - map->rehash;
+        struct bao_mapping_t *q;
+
+        for (i = lo; i < hi; i++) {
+                q = i < old ? map->old_buckets[map->rehash + i] : map->buckets[i - old];
+                for (; q; q = q->next) {
+                        p->apply_pair(q->key, q->value, ctx);
+                }
+        }
+}
+
+/*
+ * Calls apply(key, value, ctx) on every mapping from the workers of pool,
+ * grain buckets per task. The map must not change until it returns.
+ *
+ * With ctx_size 0 all calls share ctx and race on writes through it;
+ * otherwise ctx holds bao_threadpool_size(pool) slots of ctx_size bytes
+ * and each call gets the one belonging to its worker.
+ */
+BAOLIBDEF int bao_map_apply_parallel(bao_map_t map, bao_threadpool_t pool,
+                                     size_t grain,
+                                     void (*apply)(void *, void *, void *),
+                                     void *ctx, size_t ctx_size)
+{
+        struct bao_apply_parallel_t p;
+        assert(map);
+        assert(pool);
+        assert(apply);
+
+        p.pool = pool;
+        p.container = map;
+        p.apply_pair = apply;
+        p.ctx = ctx;
+        p.ctx_size = ctx_size;
+        return bao_threadpool_for(pool, 0, map->old_size - map->rehash + map->size,
+                                  grain, bao_map_apply_range, &p);
+}
+#endif /* BAO_THREADS */
+
+BAOLIBDEF void bao_map_iter_init(bao_map_t map, struct bao_map_iter_t *it)
+{
+        assert(map);
+        assert(it);
+        it->map = map;
+        it->bucket = 0;
+        it->link = NULL;
+        it->prev = NULL;
+}
+
+/*
+ * Moves to the next mapping and stores its key and value. Returns 0 once
+ * the map is exhausted. The node after the returned one is prefetched.
+ */
+BAOLIBDEF int bao_map_iter_next(struct bao_map_iter_t *it, void **key,
+                                void **value)
+{
+        bao_map_t map;
+        struct bao_mapping_t *p;
+        size_t old;
+        assert(it);
+
+        map = it->map;
+        old = map->old_size - map->rehash;
+        while (!it->link || !*it->link) {
+                if (it->bucket >= old + map->size) {
+                        it->prev = NULL;
+                        return 0;
+                }
+                it->link = it->bucket < old ? &map->old_buckets[map->rehash + it->bucket]
+                        : &map->buckets[it->bucket - old];
+                it->bucket++;
+        }
+
+        p = *it->link;
+        if (p->next)
+                BAO_PREFETCH(p->next);
+        it->prev = it->link;
+        it->link = &p->next;
+        if (key) *key = p->key;
+        if (value) *value = p->value;
+        return 1;
+}
+
+/*
+ * Removes the mapping last returned by bao_map_iter_next. Unlike
+ * bao_map_remove it never rehashes or shrinks the map, so the cursor
+ * stays valid.
+ */
+BAOLIBDEF void bao_map_iter_remove(struct bao_map_iter_t *it)
+{
+        struct bao_mapping_t *p;
+        assert(it);
+        assert(it->prev && *it->prev);
+
+        p = *it->prev;
+        *it->prev = p->next;
+        it->link = it->prev;
+        it->prev = NULL;
+        bao_map_node_free(it->map, p);
+        it->map->length--;
+}
+
+BAOLIBDEF size_t bao_map_length(bao_map_t map)
+{
+        assert(map);
+        return map->length;
+}
+
+BAOLIBDEF void bao_map_free(bao_map_t *map)
+{
+        size_t i;
+
+        assert(map);
+        assert(*map);
+
+        struct bao_mapping_t *p, *q;
+        if ((*map)->pool) {
+                bao_pool_release(&(*map)->pool);
+        } else {
+                for (i = (*map)->rehash; i < (*map)->old_size; i++) {
+                        for (p = (*map)->old_buckets[i]; p; p = q) {
+                                q = p->next;
+                                bao_dealloc((*map)->allocator, p, sizeof(*p));
+                        }
+                }
+
+                for (i = 0; i < (*map)->size; i++) {
+                        for (p = (*map)->buckets[i]; p; p = q) {
+                                q = p->next;
+                                bao_dealloc((*map)->allocator, p, sizeof(*p));
+                        }
+                }
+        }
+
+        if ((*map)->old_buckets) {
+                BAO_DEALLOC((*map)->allocator, (*map)->old_buckets,
+                            (*map)->old_size * sizeof(*(*map)->old_buckets));
+        }
+        BAO_DEALLOC((*map)->allocator, (*map)->buckets,
+                    (*map)->size * sizeof(*(*map)->buckets));
+        BAO_DEALLOC((*map)->allocator, *map, sizeof(**map));
+}
+
+#define BAO_FLATMAP_EMPTY   ((signed char) -128)
+#define BAO_FLATMAP_DELETED ((signed char) -2)
+
+/*
+ * Returns a bitmask with bit i set when ctrl[i] == c, for the
+ * BAO_FLATMAP_GROUP control bytes starting at ctrl.
+ */
+static unsigned bao_flatmap_match(const signed char *ctrl, signed char c)
+{
+#ifdef BAO_SSE2
+        __m128i group = _mm_loadu_si128((const __m128i *) ctrl);
+        return (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(c)));
+#else /* !defined(BAO_SSE2) */
+        unsigned i, mask = 0;
+        for (i = 0; i < BAO_FLATMAP_GROUP; i++)
+                mask |= (unsigned) (ctrl[i] == c) << i;
+        return mask;
+#endif /* BAO_SSE2 */
+}
+
+/*
+ * Returns a bitmask of the empty and deleted slots in the group. Full slots
+ * hold a non-negative control byte, so these are the bytes with the sign
+ * bit set.
+ */
+static unsigned bao_flatmap_match_free(const signed char *ctrl)
+{
+#ifdef BAO_SSE2
+        return (unsigned) _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) ctrl));
+#else /* !defined(BAO_SSE2) */
+        unsigned i, mask = 0;
+        for (i = 0; i < BAO_FLATMAP_GROUP; i++)
+                mask |= (unsigned) (ctrl[i] < 0) << i;
+        return mask;
+#endif /* BAO_SSE2 */
+}
+
+static size_t bao_flatmap_max_length(size_t capacity)
+{
+        return capacity - capacity / 8;
+}
+
+static int bao_flatmap_alloc(bao_flatmap_t map, size_t capacity)
+{
+        char *block;
+
+        block = BAO_MALLOC(capacity * (sizeof(*map->slots) + 1));
+        if (!block) {
+                BAO_LOG_MESSAGE("Ran out of memory!");
+                return -ENOMEM;
+        }
+
+        map->slots = (struct bao_flatslot_t *) block;
+        map->ctrl = (signed char *) (map->slots + capacity);
+        memset(map->ctrl, BAO_FLATMAP_EMPTY, capacity);
+        map->capacity = capacity;
+        map->growth_left = bao_flatmap_max_length(capacity);
+        return 0;
+}
+
+/*
+ * Returns the first empty or deleted slot on the probe sequence of h.
+ */
+static size_t bao_flatmap_find_free(bao_flatmap_t map, uint64_t h)
+{
+        size_t g, step = 0;
+        size_t gmask = map->capacity / BAO_FLATMAP_GROUP - 1;
+        unsigned mask;
+
+        g = (size_t) (h >> 7) & gmask;
+        while (!(mask = bao_flatmap_match_free(map->ctrl + g * BAO_FLATMAP_GROUP)))
+                g = (g + ++step) & gmask;
+        return g * BAO_FLATMAP_GROUP + bao_ctz(mask);
+}
+
+static int bao_flatmap_rehash(bao_flatmap_t map, size_t capacity)
+{
+        int ret;
+        size_t i, j;
+        uint64_t h;
+        signed char *old_ctrl = map->ctrl;
+        struct bao_flatslot_t *old_slots = map->slots;
+        size_t old_capacity = map->capacity;
+
+        if ((ret = bao_flatmap_alloc(map, capacity)) != 0) {
+                map->ctrl = old_ctrl;
+                map->slots = old_slots;
+                return ret;
+        }
+
+        for (i = 0; i < old_capacity; i++) {
+                if (old_ctrl[i] < 0) continue;
+                h = bao_hash_mix(map->hash(old_slots[i].key));
+                j = bao_flatmap_find_free(map, h);
+                map->ctrl[j] = (signed char) (h & 0x7f);
+                map->slots[j] = old_slots[i];
+        }
+
+        map->growth_left -= map->length;
+        BAO_FREE(old_slots);
+        return 0;
+}
+
+/*
+ * Returns the index of the slot holding key, or map->capacity if there is
+ * none.
+ */
+static size_t bao_flatmap_lookup(bao_flatmap_t map, const void *key, uint64_t h)
+{
+        size_t g, i, step = 0;
+        size_t gmask = map->capacity / BAO_FLATMAP_GROUP - 1;
+        signed char h2 = (signed char) (h & 0x7f);
+        const signed char *group;
+        unsigned mask;
+
+        g = (size_t) (h >> 7) & gmask;
+        for (;;) {
+                group = map->ctrl + g * BAO_FLATMAP_GROUP;
+                for (mask = bao_flatmap_match(group, h2); mask; mask &= mask - 1) {
+                        i = g * BAO_FLATMAP_GROUP + bao_ctz(mask);
+                        if (map->compare(key, map->slots[i].key) == 0)
+                                return i;
+                }
+
+                if (bao_flatmap_match(group, BAO_FLATMAP_EMPTY))
+                        return map->capacity;
+                if (++step > gmask)
+                        return map->capacity;
+                g = (g + step) & gmask;
+        }
+}
+
+BAOLIBDEF bao_flatmap_t bao_flatmap_create(size_t hint,
+                                           int (*compare)(const void *, const void *),
+                                           size_t (*hash)(const void *))
+{
+        bao_flatmap_t map;
+        size_t capacity;
+
+        assert(compare);
+        assert(hash);
+
+        capacity = bao_npo2(hint + hint / 7);
+        if (capacity < BAO_FLATMAP_GROUP)
+                capacity = BAO_FLATMAP_GROUP;
+
+        map = BAO_MALLOC(sizeof(*map));
+        if (!map) {
+                BAO_LOG_MESSAGE("Ran out of memory!");
+                return NULL;
+        }
+
+        map->length = 0;
+        map->compare = compare;
+        map->hash = hash;
+        if (bao_flatmap_alloc(map, capacity) != 0) {
+                BAO_FREE(map);
+                return NULL;
+        }
+
+        return map;
+}
+
+BAOLIBDEF int bao_flatmap_insert(bao_flatmap_t map, void *key, void *v, void **prev)
+{
+        int ret;
+        size_t i;
+        uint64_t h;
+
+        assert(map);
+        assert(key);
+        assert(v);
+
+        h = bao_hash_mix(map->hash(key));
+        i = bao_flatmap_lookup(map, key, h);
+        if (i != map->capacity) {
+                if (prev) *prev = map->slots[i].value;
+                map->slots[i].value = v;
+                return 0;
+        }
+
+        i = bao_flatmap_find_free(map, h);
+        if (map->growth_left == 0 && map->ctrl[i] == BAO_FLATMAP_EMPTY) {
+                /* Rehashing in place is enough when tombstones hold the space. */
+                size_t capacity = map->capacity;
+                if (map->length >= bao_flatmap_max_length(capacity) / 2)
+                        capacity <<= 1;
+                if ((ret = bao_flatmap_rehash(map, capacity)) != 0)
+                        return ret;
+                i = bao_flatmap_find_free(map, h);
+        }
+
+        if (map->ctrl[i] == BAO_FLATMAP_EMPTY)
+                map->growth_left--;
+        map->ctrl[i] = (signed char) (h & 0x7f);
+        map->slots[i].key = key;
+        map->slots[i].value = v;
+        map->length++;
+        if (prev) *prev = NULL;
+        return 0;
+}
+
+BAOLIBDEF int bao_flatmap_remove(bao_flatmap_t map, const void *key,
+                                 void **fkey, void **fv)
+{
+        size_t i;
+        const signed char *group;
+
+        assert(map);
+        assert(key);
+
+        i = bao_flatmap_lookup(map, key, bao_hash_mix(map->hash(key)));
+        if (i == map->capacity)
+                return -1;
+
+        if (fkey) *fkey = map->slots[i].key;
+        if (fv) *fv = map->slots[i].value;
+
+        /*
+         * Probes stop at the first group with an empty slot, so the slot
+         * can only become empty again if its group already has one.
+         */
+        group = map->ctrl + (i & ~(size_t) (BAO_FLATMAP_GROUP - 1));
+        if (bao_flatmap_match(group, BAO_FLATMAP_EMPTY)) {
+                map->ctrl[i] = BAO_FLATMAP_EMPTY;
+                map->growth_left++;
+        } else {
+                map->ctrl[i] = BAO_FLATMAP_DELETED;
+        }
+
+        map->length--;
+        return 0;
+}
+
+BAOLIBDEF void *bao_flatmap_find(bao_flatmap_t map, const void *key)
+{
+        size_t i;
+        assert(map);
+        assert(key);
+        i = bao_flatmap_lookup(map, key, bao_hash_mix(map->hash(key)));
+        return i != map->capacity ? map->slots[i].value : NULL;
+}
+
+BAOLIBDEF void bao_flatmap_apply(bao_flatmap_t map,
+                                 void (*apply)(void *, void *, void *),
+                                 void *arg)
+{
+        size_t i;
+        assert(map);
+        assert(apply);
+
+        for (i = 0; i < map->capacity; i++) {
+                if (map->ctrl[i] >= 0)
+                        apply(map->slots[i].key, map->slots[i].value, arg);
+        }
+}
+
+BAOLIBDEF size_t bao_flatmap_length(bao_flatmap_t map)
+{
+        assert(map);
+        return map->length;
 }
 
-BAOLIBDEF size_t bao_array_size(bao_array_t array)
+BAOLIBDEF void bao_flatmap_free(bao_flatmap_t *map)
 {
-        assert(array);
-        return array->size;
+        assert(map);
+        assert(*map);
+        BAO_FREE((*map)->slots);
+        BAO_FREE(*map);
 }
 
-BAOLIBDEF size_t bao_array_capacity(bao_array_t array)
+static size_t bao_frozenmap_bucket(bao_frozenmap_t map, size_t h)
 {
-        assert(array);
-        return array->capacity;
+        return bao_hash_mix(h) % map->nbuckets;
 }
 
-BAOLIBDEF int bao_array_empty(bao_array_t array)
+static size_t bao_frozenmap_slot(size_t h, uint64_t seed, size_t n)
 {
-        assert(array);
-        return array->size == 0;
+        return bao_hash_mix(h ^ seed) % n;
 }
 
-static int bao_array_resize(bao_array_t array)
+static uint64_t bao_frozenmap_seed(uint32_t d)
 {
-        void *new_data;
-        size_t new_capacity;
+        return bao_hash_mix((uint64_t) d + 1);
+}
 
-        new_capacity = array->capacity << 1;
-        new_data = BAO_REALLOC(array->data, new_capacity * array->memb_size);
-        if (!new_data) {
-                BAO_LOG_MESSAGE("Ran out of memory!");
-                return -ENOMEM;
+/*
+ * Places the keys of one bucket, largest buckets first: tries up to
+ * BAO_FROZENMAP_ATTEMPTS displacements until every key lands on a
+ * distinct free slot.
+ */
+static int bao_frozenmap_place(bao_frozenmap_t map, struct bao_frozenslot_t *keys,
+                               size_t count, unsigned char *taken, size_t *slots)
+{
+        uint32_t d;
+        uint64_t seed;
+        size_t i, j;
+
+        for (d = 0; d < BAO_FROZENMAP_ATTEMPTS; d++) {
+                seed = bao_frozenmap_seed(d);
+                for (i = 0; i < count; i++) {
+                        slots[i] = bao_frozenmap_slot(keys[i].hash, seed, map->length);
+                        if (taken[slots[i]])
+                                break;
+                        for (j = 0; j < i && slots[j] != slots[i]; j++)
+                                ;
+                        if (j < i)
+                                break;
+                }
+
+                if (i == count) {
+                        for (i = 0; i < count; i++) {
+                                taken[slots[i]] = 1;
+                                map->slots[slots[i]] = keys[i];
+                        }
+                        map->disp[bao_frozenmap_bucket(map, keys[0].hash)] = d;
+                        return 0;
+                }
         }
 
-        array->data = new_data;
-        memset(((char *) array->data) + array->memb_size * array->capacity,
-               0, array->memb_size * (new_capacity - array->capacity));
-        array->capacity = new_capacity;
-        return 0;
+        return -1;
 }
 
-BAOLIBDEF int bao_array_insert(bao_array_t array, void *v)
+/*
+ * Lays the keys of map out over frozen->nbuckets buckets. Returns -EAGAIN
+ * when some bucket could not be placed, so the caller can retry with more
+ * buckets, and -EINVAL when two keys share a full hash.
+ */
+static int bao_frozenmap_build(bao_frozenmap_t frozen, bao_map_t map)
 {
-        int ret;
-        assert(array);
-        assert(v);
+        struct bao_frozenslot_t *entries = NULL;
+        struct bao_map_iter_t it;
+        size_t *start = NULL, *order = NULL, *slots = NULL, *bysize = NULL;
+        unsigned char *taken = NULL;
+        size_t n = frozen->length, i, j, b, size, max = 0, next;
+        void *key, *value;
+        int ret = -ENOMEM;
+
+        BAO_FREE(frozen->disp);
+        frozen->disp = BAO_CALLOC(frozen->nbuckets, sizeof(*frozen->disp));
+        entries = BAO_MALLOC(BAO_MAX(n, 1) * sizeof(*entries));
+        start = BAO_CALLOC(frozen->nbuckets + 1, sizeof(*start));
+        order = BAO_MALLOC(frozen->nbuckets * sizeof(*order));
+        taken = BAO_CALLOC(BAO_MAX(n, 1), 1);
+        if (!frozen->disp || !entries || !start || !order || !taken) {
+                BAO_LOG_MESSAGE("Ran out of memory!");
+                goto done;
+        }
 
-        if (array->size == array->capacity) {
-                if ((ret = bao_array_resize(array)) != 0) {
-                        return ret;
+        /* Group the entries by bucket with a counting sort. */
+        bao_map_iter_init(map, &it);
+        while (bao_map_iter_next(&it, NULL, NULL))
+                start[bao_frozenmap_bucket(frozen, (*it.prev)->hash) + 1]++;
+        for (b = 0; b < frozen->nbuckets; b++) {
+                max = BAO_MAX(max, start[b + 1]);
+                start[b + 1] += start[b];
+        }
+
+        bao_map_iter_init(map, &it);
+        while (bao_map_iter_next(&it, &key, &value)) {
+                b = bao_frozenmap_bucket(frozen, (*it.prev)->hash);
+                next = start[b]++;
+                entries[next].hash = (*it.prev)->hash;
+                entries[next].key = key;
+                entries[next].value = value;
+        }
+        for (b = frozen->nbuckets; b > 0; b--)
+                start[b] = start[b - 1];
+        start[0] = 0;
+
+        /* Order the buckets by size, largest first. */
+        bysize = BAO_CALLOC(max + 2, sizeof(*bysize));
+        slots = BAO_MALLOC(BAO_MAX(max, 1) * sizeof(*slots));
+        if (!bysize || !slots) {
+                BAO_LOG_MESSAGE("Ran out of memory!");
+                goto done;
+        }
+        for (b = 0; b < frozen->nbuckets; b++)
+                bysize[max - (start[b + 1] - start[b]) + 1]++;
+        for (i = 0; i <= max; i++)
+                bysize[i + 1] += bysize[i];
+        for (b = 0; b < frozen->nbuckets; b++)
+                order[bysize[max - (start[b + 1] - start[b])]++] = b;
+
+        for (i = 0; i < frozen->nbuckets; i++) {
+                b = order[i];
+                size = start[b + 1] - start[b];
+                if (size < 2)
+                        break;
+                for (j = 1; j < size * size; j++) {
+                        if (j / size < j % size
+                            && entries[start[b] + j / size].hash
+                            == entries[start[b] + j % size].hash) {
+                                BAO_LOG_MESSAGE("Keys with identical hashes!");
+                                ret = -EINVAL;
+                                goto done;
+                        }
+                }
+                if (bao_frozenmap_place(frozen, entries + start[b], size, taken, slots) != 0) {
+                        ret = -EAGAIN;
+                        goto done;
                 }
         }
 
-        memcpy(((char *) array->data) + array->memb_size * array->size,
-               v, array->memb_size);
-        array->size++;
-        return 0;
+        /* Single-key buckets point straight at a free slot. */
+        for (next = 0; i < frozen->nbuckets && start[order[i] + 1] - start[order[i]] == 1; i++) {
+                while (taken[next])
+                        next++;
+                taken[next] = 1;
+                b = order[i];
+                frozen->slots[next] = entries[start[b]];
+                frozen->disp[b] = BAO_FROZENMAP_DIRECT | (uint32_t) next;
+        }
+        ret = 0;
+
+done:
+        BAO_FREE(entries);
+        BAO_FREE(start);
+        BAO_FREE(order);
+        BAO_FREE(taken);
+        BAO_FREE(bysize);
+        BAO_FREE(slots);
+        return ret;
 }
 
-BAOLIBDEF int bao_array_insert2(bao_array_t array, void *vs, const size_t count)
+/*
+ * Builds a frozen copy of map with a minimal perfect hash over its keys.
+ * The map itself is left as it is. When a bucket cannot be placed, the
+ * build starts over with half again as many buckets, up to
+ * BAO_FROZENMAP_RETRIES times. Fails when two keys have the same full
+ * hash, since no displacement can separate them.
+ */
+BAOLIBDEF bao_frozenmap_t bao_map_freeze(bao_map_t map)
 {
-        int ret;
-        assert(array);
-        assert(vs);
-        assert(count > 0);
+        bao_frozenmap_t frozen;
+        size_t n;
+        int ret, retry;
+        assert(map);
 
-        while (array->size + count >= array->capacity) {
-                if ((ret = bao_array_resize(array)) != 0) {
-                        return ret;
+        n = map->length;
+        if (n >= BAO_FROZENMAP_DIRECT) {
+                BAO_LOG_MESSAGE("Too many keys to freeze!");
+                return NULL;
+        }
+
+        frozen = BAO_MALLOC(sizeof(*frozen));
+        if (!frozen) {
+                BAO_LOG_MESSAGE("Ran out of memory!");
+                return NULL;
+        }
+
+        frozen->length = n;
+        frozen->nbuckets = BAO_MAX((n + BAO_FROZENMAP_LOAD - 1) / BAO_FROZENMAP_LOAD, 1);
+        frozen->compare = map->compare;
+        frozen->hash = map->hash;
+        frozen->disp = NULL;
+        frozen->slots = BAO_MALLOC(BAO_MAX(n, 1) * sizeof(*frozen->slots));
+        if (!frozen->slots) {
+                BAO_LOG_MESSAGE("Ran out of memory!");
+                bao_frozenmap_free(&frozen);
+                return NULL;
+        }
+
+        for (retry = 0;; retry++) {
+                ret = bao_frozenmap_build(frozen, map);
+                if (ret != -EAGAIN)
+                        break;
+                if (retry == BAO_FROZENMAP_RETRIES) {
+                        BAO_LOG_MESSAGE("Could not place bucket!");
+                        break;
                 }
+                frozen->nbuckets += frozen->nbuckets / 2 + 1;
         }
 
-        memcpy(((char *) array->data) + array->memb_size * array->size,
-               vs, array->memb_size * count);
-        array->size += count;
-        return 0;
+        if (ret != 0)
+                bao_frozenmap_free(&frozen);
+        return frozen;
 }
 
-BAOLIBDEF int bao_array_insert_at(bao_array_t array, void *v, size_t index)
+BAOLIBDEF void *bao_frozenmap_find(bao_frozenmap_t map, const void *key)
 {
-        assert(array);
-        assert(v);
-        assert(index >= 0 && index < bao_array_size(array));
+        struct bao_frozenslot_t *slot;
+        size_t h, i;
+        uint32_t d;
+        assert(map);
+        assert(key);
 
-        memcpy(((char *) array->data) + array->memb_size * index,
-               v, array->memb_size);
-        return 0;
+        if (map->length == 0)
+                return NULL;
+
+        h = map->hash(key);
+        d = map->disp[bao_frozenmap_bucket(map, h)];
+        if (d & BAO_FROZENMAP_DIRECT)
+                i = d & ~BAO_FROZENMAP_DIRECT;
+        else
+                i = bao_frozenmap_slot(h, bao_frozenmap_seed(d), map->length);
+
+        slot = &map->slots[i];
+        if (slot->hash == h && map->compare(key, slot->key) == 0)
+                return slot->value;
+        return NULL;
 }
 
-BAOLIBDEF void bao_array_apply(bao_array_t array, void (*apply)(void *))
+BAOLIBDEF void bao_frozenmap_apply(bao_frozenmap_t map,
+                                   void (*apply)(void *, void *, void *),
+                                   void *arg)
 {
         size_t i;
-        void *elem;
-        assert(array);
+        assert(map);
         assert(apply);
 
-        for (i = 0; i < array->size; i++) {
-                elem = ((char *) array->data) + i * array->memb_size;
-                apply(elem);
-        }
+        for (i = 0; i < map->length; i++)
+                apply(map->slots[i].key, map->slots[i].value, arg);
 }
 
-BAOLIBDEF void *bao_array_pop(bao_array_t array)
+BAOLIBDEF size_t bao_frozenmap_length(bao_frozenmap_t map)
 {
-        assert(array);
-        void *v;
-        if (bao_array_empty(array)) {
-                return NULL;
-        }
+        assert(map);
+        return map->length;
+}
 
-        v = bao_array_get(array, array->size-1);
-        array->size--;
-        return v;
+BAOLIBDEF void bao_frozenmap_free(bao_frozenmap_t *map)
+{
+        assert(map && *map);
+        BAO_FREE((*map)->disp);
+        BAO_FREE((*map)->slots);
+        BAO_FREE(*map);
 }
 
-BAOLIBDEF void *bao_array_get(bao_array_t array, size_t i)
+static uint64_t bao_file_align_to(uint64_t offset, uint64_t align)
 {
-        assert(array);
-        assert(i >= 0 && i < bao_array_capacity(array));
-        return ((char *) array->data) + i * array->memb_size;
+        return (offset + align - 1) / align * align;
 }
 
-BAOLIBDEF void bao_array_clear(bao_array_t array)
+static uint64_t bao_file_align(uint64_t offset)
 {
-        assert(array);
-        array->size = 0;
-        memset(array->data, 0, array->capacity * array->memb_size);
+        return bao_file_align_to(offset, BAO_FILE_ALIGN);
 }
 
-BAOLIBDEF void *bao_array_find(bao_array_t array, void *v,
-                               int (*compare)(void *, void *))
+/*
+ * Writes size bytes, then zeroes up to the next multiple of align, which
+ * is at most BAO_FILE_ALIGN.
+ */
+static int bao_file_put(FILE *fp, const void *p, size_t size, uint64_t align,
+                        uint64_t *offset)
 {
-        size_t i;
-        void *elem;
+        static const char zeros[BAO_FILE_ALIGN];
+        uint64_t end = bao_file_align_to(*offset + size, align);
+
+        if (size && fwrite(p, 1, size, fp) != size)
+                return -EIO;
+        if (end - *offset - size && fwrite(zeros, 1, end - *offset - size, fp)
+            != end - *offset - size)
+                return -EIO;
+        *offset = end;
+        return 0;
+}
+
+static void bao_file_header_init(struct bao_file_header_t *header, uint32_t kind)
+{
+        memset(header, 0, sizeof(*header));
+        memcpy(header->magic, BAO_FILE_MAGIC, sizeof(BAO_FILE_MAGIC));
+        header->version = BAO_FILE_VERSION;
+        header->byte_order = BAO_FILE_BYTE_ORDER;
+        header->kind = kind;
+        header->word_size = sizeof(size_t);
+}
+
+static int bao_file_close(FILE *fp, int ret, const char *path)
+{
+        if (fclose(fp) != 0 && ret == 0)
+                ret = -EIO;
+        if (ret != 0) {
+                BAO_LOG_MESSAGE("Could not write '%s'!", path);
+                remove(path);
+        }
+        return ret;
+}
+
+/*
+ * Writes the elements of array to path. The file can be loaded with
+ * bao_mapped_open and bao_mapped_array.
+ */
+BAOLIBDEF int bao_array_write(bao_array_t array, const char *path)
+{
+        struct bao_file_header_t header;
+        uint64_t offset = 0;
+        FILE *fp;
+        int ret;
         assert(array);
-        assert(compare);
-        assert(v);
+        assert(path);
 
-        for (i = 0; i < array->size; i++) {
-                elem = ((char *) array->data) + i * array->memb_size;
-                if (compare(elem, v) == 0) return elem;
+        if (!(fp = fopen(path, "wb"))) {
+                BAO_LOG_MESSAGE("Could not open '%s'!", path);
+                return -errno;
         }
 
-        return NULL;
+        bao_file_header_init(&header, BAO_FILE_ARRAY);
+        header.count = array->size;
+        header.memb_size = array->memb_size;
+        header.data_offset = bao_file_align(sizeof(header));
+        header.size = bao_file_align(header.data_offset + array->size * array->memb_size);
+
+        ret = bao_file_put(fp, &header, sizeof(header), BAO_FILE_ALIGN, &offset);
+        if (ret == 0)
+                ret = bao_file_put(fp, array->data, array->size * array->memb_size,
+                                   BAO_FILE_ALIGN, &offset);
+        return bao_file_close(fp, ret, path);
 }
 
-BAOLIBDEF void bao_array_free(bao_array_t *array)
+/*
+ * Runs encode into *buf, growing it when the object does not fit.
+ */
+static size_t bao_file_encode(size_t (*encode)(const void *, void *, size_t),
+                              const void *obj, char **buf, size_t *cap)
 {
-        assert(array && *array);
-        BAO_FREE((*array)->data);
-        BAO_FREE(*array);
+        size_t size;
+        char *p;
+
+        size = encode(obj, *buf, *cap);
+        if (size > *cap) {
+                if (!(p = BAO_REALLOC(*buf, size)))
+                        return SIZE_MAX;
+                *buf = p;
+                *cap = size;
+                size = encode(obj, *buf, *cap);
+        }
+        return size;
 }
 
-BAOLIBDEF bao_list_t bao_list_create(void *v)
+/*
+ * Writes map to path. Keys and values are pointers, so encode_key and
+ * encode_value turn each into bytes: given an object and a buffer of cap
+ * bytes, they return the encoded size and fill the buffer when it is
+ * large enough. Each object is encoded once to lay out the file and again
+ * to write it, so an encoder must give the same bytes every time; the
+ * write fails with -EINVAL if a size changes in between. Lookups on the
+ * loaded file compare encoded key bytes.
+ */
+BAOLIBDEF int bao_frozenmap_write(bao_frozenmap_t map, const char *path,
+                                  size_t (*encode_key)(const void *, void *, size_t),
+                                  size_t (*encode_value)(const void *, void *, size_t))
 {
-        bao_list_t list;
-
-        assert(v);
+        struct bao_file_header_t header;
+        struct bao_fileslot_t slot;
+        uint64_t offset = 0, blob = 0;
+        char *buf = NULL;
+        size_t i, size = 0, cap = 0, *sizes;
+        FILE *fp;
+        int ret;
+        assert(map);
+        assert(path);
+        assert(encode_key);
+        assert(encode_value);
 
-        list = BAO_MALLOC(sizeof(*list));
-        if (!list) {
+        sizes = BAO_MALLOC(BAO_MAX(2 * map->length, 1) * sizeof(*sizes));
+        if (!sizes) {
                 BAO_LOG_MESSAGE("Ran out of memory!");
-                return NULL;
+                return -ENOMEM;
         }
 
-        list->data = v;
-        list->rest = NULL;
-        return list;
+        if (!(fp = fopen(path, "wb"))) {
+                BAO_LOG_MESSAGE("Could not open '%s'!", path);
+                BAO_FREE(sizes);
+                return -errno;
+        }
+
+        bao_file_header_init(&header, BAO_FILE_FROZENMAP);
+        header.count = map->length;
+        header.nbuckets = map->nbuckets;
+        header.data_offset = bao_file_align(sizeof(header));
+        header.slots_offset = bao_file_align(header.data_offset +
+                                             map->nbuckets * sizeof(*map->disp));
+        header.blob_offset = bao_file_align(header.slots_offset +
+                                            map->length * sizeof(slot));
+
+        /* Lay out the blob first: every key, then its value, each aligned. */
+        ret = bao_file_put(fp, &header, sizeof(header), BAO_FILE_ALIGN, &offset);
+        if (ret == 0)
+                ret = bao_file_put(fp, map->disp, map->nbuckets * sizeof(*map->disp),
+                                   BAO_FILE_ALIGN, &offset);
+        for (i = 0; ret == 0 && i < map->length; i++) {
+                slot.hash = map->slots[i].hash;
+                slot.key_offset = header.blob_offset + blob;
+                if ((size = bao_file_encode(encode_key, map->slots[i].key, &buf, &cap))
+                    == SIZE_MAX) {
+                        ret = -ENOMEM;
+                        break;
+                }
+                sizes[2 * i] = slot.key_size = size;
+                blob = bao_file_align_to(blob + size, BAO_FILE_ITEM_ALIGN);
+                slot.value_offset = header.blob_offset + blob;
+                if ((size = bao_file_encode(encode_value, map->slots[i].value, &buf, &cap))
+                    == SIZE_MAX) {
+                        ret = -ENOMEM;
+                        break;
+                }
+                sizes[2 * i + 1] = slot.value_size = size;
+                blob = bao_file_align_to(blob + size, BAO_FILE_ITEM_ALIGN);
+                if (fwrite(&slot, sizeof(slot), 1, fp) != 1)
+                        ret = -EIO;
+                offset += sizeof(slot);
+        }
+        if (ret == 0)
+                ret = bao_file_put(fp, NULL, 0, BAO_FILE_ALIGN, &offset);
+
+        for (i = 0; ret == 0 && i < 2 * map->length; i++) {
+                size = bao_file_encode(i % 2 ? encode_value : encode_key,
+                                       i % 2 ? map->slots[i / 2].value : map->slots[i / 2].key,
+                                       &buf, &cap);
+                if (size == SIZE_MAX)
+                        ret = -ENOMEM;
+                else if (size != sizes[i])
+                        ret = -EINVAL;
+                else
+                        ret = bao_file_put(fp, buf, size, BAO_FILE_ITEM_ALIGN, &offset);
+        }
+
+        /* The header goes last, once the total size is known. */
+        header.blob_size = blob;
+        header.size = header.blob_offset + blob;
+        if (ret == 0 && (fseek(fp, 0, SEEK_SET) != 0
+                         || fwrite(&header, sizeof(header), 1, fp) != 1))
+                ret = -EIO;
+
+        BAO_FREE(buf);
+        BAO_FREE(sizes);
+        return bao_file_close(fp, ret, path);
 }
 
-BAOLIBDEF bao_list_t bao_list_push(bao_list_t list, void *v)
+/*
+ * Returns nonzero unless size bytes at offset fit within limit.
+ */
+static int bao_mapped_outside(uint64_t offset, uint64_t size, uint64_t limit)
 {
-        bao_list_t rest;
-        assert(v);
+        return offset > limit || size > limit - offset;
+}
 
-        rest = bao_list_create(v);
-        if (!rest) {
-                BAO_LOG_MESSAGE("Ran out of memory!");
-                return list;
+/*
+ * Validates the header of a loaded file: its sections must lie within the
+ * file. Slots are only checked as lookups read them, so opening a file
+ * does not page it all in; bao_mapped_verify checks them all up front.
+ */
+static int bao_mapped_check(bao_mapped_t file)
+{
+        const struct bao_file_header_t *h = file->base;
+        uint64_t slot = sizeof(struct bao_fileslot_t);
+
+        if (file->size < sizeof(*h) || memcmp(h->magic, BAO_FILE_MAGIC, sizeof(BAO_FILE_MAGIC))
+            || h->version != BAO_FILE_VERSION || h->byte_order != BAO_FILE_BYTE_ORDER
+            || h->word_size != sizeof(size_t) || h->size > file->size
+            || h->data_offset % BAO_FILE_ALIGN != 0)
+                return -1;
+
+        switch (h->kind) {
+        case BAO_FILE_ARRAY:
+                return h->memb_size == 0 || h->data_offset > h->size
+                        || h->count > (h->size - h->data_offset) / h->memb_size ? -1 : 0;
+        case BAO_FILE_FROZENMAP:
+                return h->nbuckets == 0 || h->count >= BAO_FROZENMAP_DIRECT
+                        || h->slots_offset % BAO_FILE_ALIGN != 0
+                        || h->nbuckets > h->size / sizeof(uint32_t)
+                        || bao_mapped_outside(h->data_offset, h->nbuckets * sizeof(uint32_t),
+                                              h->size)
+                        || h->count > h->size / slot
+                        || bao_mapped_outside(h->slots_offset, h->count * slot, h->size)
+                        || bao_mapped_outside(h->blob_offset, h->blob_size, h->size) ? -1 : 0;
+        default:
+                return -1;
         }
+}
 
-        rest->data = v;
-        rest->rest = list;
-        return rest;
+/*
+ * Returns nonzero unless the key and value of slot lie within the file.
+ */
+static int bao_mapped_bad_slot(const struct bao_file_header_t *h,
+                               const struct bao_fileslot_t *slot)
+{
+        return bao_mapped_outside(slot->key_offset, slot->key_size, h->size)
+                || bao_mapped_outside(slot->value_offset, slot->value_size, h->size);
 }
 
-BAOLIBDEF bao_list_t bao_list_pop(bao_list_t list, void **v)
+/*
+ * Opens a file written by bao_array_write or bao_frozenmap_write. With
+ * mmap the file is mapped read-only and its pages are loaded on demand
+ * and shared between processes.
+ */
+BAOLIBDEF bao_mapped_t bao_mapped_open(const char *path)
 {
-        bao_list_t head;
-        if (!list) return list;
+        bao_mapped_t file;
+        FILE *fp;
+        long size;
+        assert(path);
 
-        head = list->rest;
-        if (v) *v = list->data;
-        BAO_FREE(list);
-        return head;
+        file = BAO_MALLOC(sizeof(*file));
+        if (!file) {
+                BAO_LOG_MESSAGE("Ran out of memory!");
+                return NULL;
+        }
+
+        if (!(fp = fopen(path, "rb"))) {
+                BAO_LOG_MESSAGE("Could not open '%s'!", path);
+                BAO_FREE(file);
+                return NULL;
+        }
+
+        file->base = NULL;
+        file->mapped = 0;
+        if (fseek(fp, 0, SEEK_END) != 0 || (size = ftell(fp)) < 0) {
+                fclose(fp);
+                BAO_LOG_MESSAGE("Could not read '%s'!", path);
+                BAO_FREE(file);
+                return NULL;
+        }
+        file->size = (size_t) size;
+
+#ifdef BAO_MMAP
+        if (file->size > 0) {
+                file->base = mmap(NULL, file->size, PROT_READ, MAP_SHARED, fileno(fp), 0);
+                if (file->base == MAP_FAILED)
+                        file->base = NULL;
+                else
+                        file->mapped = 1;
+        }
+#endif /* BAO_MMAP */
+        if (!file->mapped) {
+                file->base = BAO_MALLOC(BAO_MAX(file->size, 1));
+                if (!file->base || fseek(fp, 0, SEEK_SET) != 0
+                    || fread(file->base, 1, file->size, fp) != file->size) {
+                        fclose(fp);
+                        BAO_LOG_MESSAGE("Could not read '%s'!", path);
+                        bao_mapped_close(&file);
+                        return NULL;
+                }
+        }
+        fclose(fp);
+
+        if (bao_mapped_check(file) != 0) {
+                BAO_LOG_MESSAGE("'%s' is not a valid bao file!", path);
+                bao_mapped_close(&file);
+                return NULL;
+        }
+
+        file->header = file->base;
+        return file;
 }
 
-BAOLIBDEF void *bao_list_get(bao_list_t list, size_t i)
+/*
+ * Sets up array as a read-only view of a mapped array file. The view
+ * borrows the file's storage: growing it copies the elements to the heap,
+ * but nothing may write to them in place. Release it with bao_array_fini.
+ */
+BAOLIBDEF int bao_mapped_array(bao_mapped_t file, struct bao_array_t *array)
 {
-        size_t j;
-        for (j = 0; j < i && list; j++) {
-                list = list->rest;
-        }
+        assert(file);
+        assert(array);
 
-        return list ? list->data : NULL;
+        if (file->header->kind != BAO_FILE_ARRAY)
+                return -EINVAL;
+
+        array->size = file->header->count;
+        array->memb_size = file->header->memb_size;
+        array->capacity = file->header->count;
+        array->data = (char *) file->base + file->header->data_offset;
+        array->allocator = NULL;
+        array->flags = BAO_ARRAY_BORROWED | BAO_ARRAY_NO_ZERO;
+        array->inline_capacity = 0;
+        return 0;
 }
 
-BAOLIBDEF bao_list_t bao_list_append(bao_list_t a_list, bao_list_t b_list)
+/*
+ * Looks up a key in a mapped frozen map. key and key_size are the key's
+ * encoded bytes and hash is the hash the map was built with. Returns the
+ * value's encoded bytes, aligned to BAO_FILE_ITEM_ALIGN, or NULL. A slot
+ * whose ranges fall outside the file is treated as missing.
+ */
+BAOLIBDEF const void *bao_mapped_find(bao_mapped_t file, const void *key,
+                                      size_t key_size, size_t hash,
+                                      size_t *value_size)
 {
-        bao_list_t *head = &a_list;
+        const struct bao_file_header_t *h;
+        const struct bao_fileslot_t *slot;
+        const char *base;
+        uint32_t d;
+        size_t i;
+        assert(file);
+        assert(key);
 
-        while (*head) {
-                head = &(*head)->rest;
-        }
-        *head = b_list;
-        return a_list;
+        h = file->header;
+        base = file->base;
+        if (h->kind != BAO_FILE_FROZENMAP || h->count == 0)
+                return NULL;
+
+        d = ((const uint32_t *) (base + h->data_offset))[bao_hash_mix(hash) % h->nbuckets];
+        if (d & BAO_FROZENMAP_DIRECT)
+                i = d & ~BAO_FROZENMAP_DIRECT;
+        else
+                i = bao_frozenmap_slot(hash, bao_frozenmap_seed(d), h->count);
+        if (i >= h->count)
+                return NULL;
+
+        slot = (const struct bao_fileslot_t *) (base + h->slots_offset) + i;
+        if (bao_mapped_bad_slot(h, slot))
+                return NULL;
+        if (slot->hash != hash || slot->key_size != key_size
+            || memcmp(base + slot->key_offset, key, key_size) != 0)
+                return NULL;
+        if (value_size)
+                *value_size = slot->value_size;
+        return base + slot->value_offset;
 }
 
-BAOLIBDEF void bao_list_free(bao_list_t *list)
+/*
+ * Returns the number of elements or entries in a mapped file.
+ */
+BAOLIBDEF size_t bao_mapped_length(bao_mapped_t file)
 {
-        bao_list_t next;
+        assert(file);
+        return file->header->count;
+}
 
-        assert(list);
-        for (; *list; *list = next) {
-                next = (*list)->rest;
-                BAO_FREE(*list);
+/*
+ * Checks every displacement and slot of a mapped frozen map, which reads
+ * the whole table. Lookups check the slot they read in any case, so this
+ * is only needed to reject a damaged file before serving from it. Returns
+ * 0 when the file is sound and -EINVAL otherwise.
+ */
+BAOLIBDEF int bao_mapped_verify(bao_mapped_t file)
+{
+        const struct bao_file_header_t *h;
+        const struct bao_fileslot_t *slots;
+        const uint32_t *disp;
+        uint64_t i;
+        assert(file);
+
+        h = file->header;
+        if (h->kind != BAO_FILE_FROZENMAP)
+                return 0;
+
+        disp = (const uint32_t *) ((const char *) file->base + h->data_offset);
+        for (i = 0; i < h->nbuckets; i++)
+                if ((disp[i] & BAO_FROZENMAP_DIRECT)
+                    && (disp[i] & ~BAO_FROZENMAP_DIRECT) >= h->count)
+                        return -EINVAL;
+
+        slots = (const struct bao_fileslot_t *) ((const char *) file->base + h->slots_offset);
+        for (i = 0; i < h->count; i++)
+                if (bao_mapped_bad_slot(h, &slots[i]))
+                        return -EINVAL;
+        return 0;
+}
+
+BAOLIBDEF void bao_mapped_close(bao_mapped_t *file)
+{
+        assert(file && *file);
+#ifdef BAO_MMAP
+        if ((*file)->mapped) {
+                munmap((*file)->base, (*file)->size);
+                (*file)->base = NULL;
         }
+#endif /* BAO_MMAP */
+        if ((*file)->base)
+                BAO_FREE((*file)->base);
+        BAO_FREE(*file);
 }
 
-BAOLIBDEF bao_map_t bao_map_create(size_t hint,
-                                   int (*compare)(const void *, const void *),
-                                   size_t hash(const void *))
+#ifdef BAO_THREADS
+/*
+ * Creates a concurrent map of nsegments segments, rounded up to a power
+ * of two, or BAO_CMAP_SEGMENTS when nsegments is 0.
+ */
+BAOLIBDEF bao_cmap_t bao_cmap_create(size_t hint, size_t nsegments,
+                                     int (*compare)(const void *, const void *),
+                                     size_t (*hash)(const void *))
 {
-        bao_map_t map;
+        bao_cmap_t map;
         size_t i;
-        static int primes[] = {
-                509, 509, 1021, 2053, 4093,
-                8191, 16381, 32771, 65521, INT_MAX
-        };
-
         assert(compare);
         assert(hash);
 
-        for (i = 1; primes[i] < hint; i++)
-                ;
-        map = BAO_MALLOC(sizeof(*map) + primes[i-1] * sizeof(map->buckets[0]));
+        nsegments = bao_npo2(nsegments ? nsegments : BAO_CMAP_SEGMENTS);
+        map = BAO_MALLOC(sizeof(*map));
         if (!map) {
                 BAO_LOG_MESSAGE("Ran out of memory!");
                 return NULL;
         }
 
-        map->size = primes[i-1];
-        map->length = 0;
-        map->compare = compare;
+        map->segments = BAO_CALLOC(nsegments, sizeof(*map->segments));
+        if (!map->segments) {
+                BAO_LOG_MESSAGE("Ran out of memory!");
+                BAO_FREE(map);
+                return NULL;
+        }
+
+        map->nsegments = nsegments;
         map->hash = hash;
-        map->buckets = (struct bao_mapping_t **) (map + 1);
-        for (i = 0; i < map->size; i++)
-                map->buckets[i] = NULL;
+        for (map->shift = 64; nsegments > 1; nsegments >>= 1)
+                map->shift--;
+
+        for (i = 0; i < map->nsegments; i++) {
+                map->segments[i].map = bao_map_create(hint / map->nsegments,
+                                                      compare, hash);
+                if (!map->segments[i].map) {
+                        map->nsegments = i;
+                        bao_cmap_free(&map);
+                        return NULL;
+                }
+                pthread_rwlock_init(&map->segments[i].lock, NULL);
+        }
+
         return map;
 }
 
-#include <stdio.h>
-BAOLIBDEF int bao_map_insert(bao_map_t map, void *key, void *v, void **prev)
+static struct bao_cmap_segment_t *bao_cmap_segment(bao_cmap_t map, size_t h)
 {
-        size_t i;
-        struct bao_mapping_t *p;
+        if (map->nsegments == 1)
+                return map->segments;
+        return &map->segments[bao_hash_mix(h) >> map->shift];
+}
 
+BAOLIBDEF int bao_cmap_insert(bao_cmap_t map, void *key, void *v, void **prev)
+{
+        struct bao_cmap_segment_t *seg;
+        size_t h;
+        int ret;
         assert(map);
         assert(key);
         assert(v);
 
-        i = map->hash(key) % map->size;
-        for (p = map->buckets[i]; p; p = p->next)
-                if (map->compare(key, p->key) == 0)
-                        break;
-
-        if (p == NULL) {
-                p = BAO_MALLOC(sizeof(*p));
-                if (!p) {
-                        BAO_LOG_MESSAGE("Ran out of memory!");
-                        return -ENOMEM;
-                }
-                p->key = key;
-                p->next = map->buckets[i];
-                map->buckets[i] = p;
-                map->length++;
-                if (prev) *prev = NULL;
-        } else if (prev) {
-                *prev = p->value;
-        }
-
-        p->value = v;
-        return 0;
+        h = map->hash(key);
+        seg = bao_cmap_segment(map, h);
+        pthread_rwlock_wrlock(&seg->lock);
+        bao_map_rehash_step(seg->map);
+        ret = bao_map_insert_hashed(seg->map, key, v, h, prev);
+        pthread_rwlock_unlock(&seg->lock);
+        return ret;
 }
 
-BAOLIBDEF int bao_map_remove(bao_map_t map, const void *key,
-                             void **fkey, void **fv)
+BAOLIBDEF int bao_cmap_remove(bao_cmap_t map, const void *key,
+                              void **fkey, void **fv)
 {
-        size_t i;
-        struct bao_mapping_t **pp;
-
+        struct bao_cmap_segment_t *seg;
+        size_t h;
+        int ret;
         assert(map);
         assert(key);
-        i = map->hash(key) % map->size;
-        for (pp = &map->buckets[i]; *pp; pp = &(*pp)->next) {
-                if (map->compare(key, (*pp)->key) == 0) {
-                        struct bao_mapping_t *p = *pp;
-                        void *value = p->value;
-                        void *key = p->key;
-                        *pp = p->next;
-                        BAO_FREE(p);
-                        map->length--;
-                        if (fkey) {
-                                *fkey = key;
-                        }
-
-                        if (fv) {
-                                *fv = value;
-                        }
-                        return 0;
-                }
-        }
 
-        return -1;
+        h = map->hash(key);
+        seg = bao_cmap_segment(map, h);
+        pthread_rwlock_wrlock(&seg->lock);
+        bao_map_rehash_step(seg->map);
+        ret = bao_map_remove_hashed(seg->map, key, h, fkey, fv);
+        pthread_rwlock_unlock(&seg->lock);
+        return ret;
 }
 
-BAOLIBDEF void *bao_map_find(bao_map_t map, void *key)
+/*
+ * Lookups leave the segment untouched, so any number of them can run
+ * under its read lock. A pending resize advances only when a later insert
+ * or remove takes the write lock.
+ */
+BAOLIBDEF void *bao_cmap_find(bao_cmap_t map, const void *key)
 {
-        size_t i;
-        struct bao_mapping_t *p;
+        struct bao_cmap_segment_t *seg;
+        size_t h;
+        void *v;
         assert(map);
         assert(key);
-        i = map->hash(key) % map->size;
-        for (p = map->buckets[i]; p; p = p->next)
-                if (map->compare(key, p->key) == 0)
-                        break;
-        return p ? p->value : NULL;
+
+        h = map->hash(key);
+        seg = bao_cmap_segment(map, h);
+        pthread_rwlock_rdlock(&seg->lock);
+        v = bao_map_find_hashed(seg->map, key, h);
+        pthread_rwlock_unlock(&seg->lock);
+        return v;
 }
 
-BAOLIBDEF void bao_map_apply(bao_map_t map, void (*apply)(void *, void *, void *),
-                             void *arg)
+/*
+ * Applies to every mapping one segment at a time, holding that segment's
+ * read lock. apply must not modify the map.
+ */
+BAOLIBDEF void bao_cmap_apply(bao_cmap_t map, void (*apply)(void *, void *, void *),
+                              void *arg)
 {
         size_t i;
-        struct bao_mapping_t *p;
         assert(map);
         assert(apply);
 
-        for (i = 0; i < map->size; i++) {
-                for (p = map->buckets[i]; p; p = p->next) {
-                        apply(p->key, p->value, arg);
-                }
+        for (i = 0; i < map->nsegments; i++) {
+                pthread_rwlock_rdlock(&map->segments[i].lock);
+                bao_map_apply(map->segments[i].map, apply, arg);
+                pthread_rwlock_unlock(&map->segments[i].lock);
         }
 }
 
-BAOLIBDEF size_t bao_map_length(bao_map_t map)
+BAOLIBDEF size_t bao_cmap_length(bao_cmap_t map)
 {
+        size_t i, length = 0;
         assert(map);
-        return map->length;
+
+        for (i = 0; i < map->nsegments; i++) {
+                pthread_rwlock_rdlock(&map->segments[i].lock);
+                length += map->segments[i].map->length;
+                pthread_rwlock_unlock(&map->segments[i].lock);
+        }
+
+        return length;
 }
 
-BAOLIBDEF void bao_map_free(bao_map_t *map)
+BAOLIBDEF void bao_cmap_free(bao_cmap_t *map)
 {
         size_t i;
+        assert(map && *map);
 
-        assert(map);
-        assert(*map);
+        for (i = 0; i < (*map)->nsegments; i++) {
+                pthread_rwlock_destroy(&(*map)->segments[i].lock);
+                bao_map_free(&(*map)->segments[i].map);
+        }
+        BAO_FREE((*map)->segments);
+        BAO_FREE(*map);
+}
+#endif /* BAO_THREADS */
 
-        struct bao_mapping_t *p, *q;
-        for (i = 0; i < (*map)->size; i++) {
-                for (p = (*map)->buckets[i]; p; p = q) {
+static struct bao_member_t **bao_set_bucket(bao_set_t set, size_t h)
+{
+        size_t i;
+        if (set->old_buckets) {
+                i = h % set->old_size;
+                if (i >= set->rehash)
+                        return &set->old_buckets[i];
+        }
+        return &set->buckets[h % set->size];
+}
+
+static void bao_set_rehash_step(bao_set_t set)
+{
+        size_t i, n = BAO_HASH_REHASH_STEP, visits = n * 10;
+        struct bao_member_t *p, *q;
+
+        if (!set->old_buckets) return;
+
+        while (n && visits && set->rehash < set->old_size) {
+                p = set->old_buckets[set->rehash];
+                set->old_buckets[set->rehash++] = NULL;
+                visits--;
+                if (!p) continue;
+                for (; p; p = q) {
                         q = p->next;
-                        BAO_FREE(p);
+                        i = p->hash % set->size;
+                        p->next = set->buckets[i];
+                        set->buckets[i] = p;
                 }
+                n--;
         }
-        BAO_FREE(*map);
+
+        if (set->rehash == set->old_size) {
+                BAO_DEALLOC(set->allocator, set->old_buckets,
+                            set->old_size * sizeof(*set->old_buckets));
+                set->old_size = 0;
+                set->rehash = 0;
+        }
+}
+
+static struct bao_member_t *bao_set_node_alloc(bao_set_t set)
+{
+        if (set->pool)
+                return bao_pool_alloc(set->pool);
+        return bao_alloc(set->allocator, sizeof(struct bao_member_t));
+}
+
+static void bao_set_node_free(bao_set_t set, struct bao_member_t *p)
+{
+        if (set->pool)
+                bao_pool_put(set->pool, p);
+        else
+                bao_dealloc(set->allocator, p, sizeof(*p));
+}
+
+static void bao_set_resize(bao_set_t set)
+{
+        size_t size;
+        struct bao_member_t **buckets;
+
+        if (set->old_buckets) return;
+
+        if (set->length > set->size * BAO_HASH_LOAD) {
+                size = bao_hash_size(set->size + 1);
+        } else if (set->length < set->size / BAO_HASH_SHRINK
+                   && set->size > set->min_size) {
+                size = BAO_MAX(bao_hash_size(set->length * 2), set->min_size);
+        } else {
+                return;
+        }
+
+        if (size == set->size) return;
+
+        buckets = bao_calloc(set->allocator, size, sizeof(*buckets));
+        if (!buckets) {
+                BAO_LOG_MESSAGE("Ran out of memory!");
+                return;
+        }
+
+        set->old_buckets = set->buckets;
+        set->old_size = set->size;
+        set->rehash = 0;
+        set->buckets = buckets;
+        set->size = size;
 }
 
 BAOLIBDEF bao_set_t bao_set_create(size_t hint,
                                    int (*compare)(const void *, const void *),
                                    size_t (*hash)(const void *))
 {
-        size_t i;
+        return bao_set_create2(hint, compare, hash, NULL);
+}
+
+BAOLIBDEF bao_set_t bao_set_create2(size_t hint,
+                                    int (*compare)(const void *, const void *),
+                                    size_t (*hash)(const void *),
+                                    bao_allocator_t allocator)
+{
         bao_set_t set;
-        static int primes[] = {
-                509, 509, 1021, 2053, 4093,
-                8191, 16381, 32771, 65521, INT_MAX
-        };
 
-        for (i = 1; primes[i] < hint; i++)
-                ;
-        set = BAO_MALLOC(sizeof(*set) + primes[i-1] * sizeof(set->buckets[0]));
+        set = bao_alloc(allocator, sizeof(*set));
         if (!set) {
                 BAO_LOG_MESSAGE("Ran out of memory!");
                 return NULL;
         }
 
-        set->size = primes[i-1];
+        set->allocator = allocator;
+        set->size = set->min_size = bao_hash_initial_size(hint);
+        set->buckets = bao_calloc(allocator, set->size, sizeof(*set->buckets));
+        if (!set->buckets) {
+                BAO_LOG_MESSAGE("Ran out of memory!");
+                BAO_DEALLOC(allocator, set, sizeof(*set));
+                return NULL;
+        }
+
         set->compare = compare;
         set->hash = hash;
-        set->buckets = (struct bao_member_t **) (set + 1);
-        for (i = 0; i < set->size; i++)
-                set->buckets[i] = NULL;
+        set->old_buckets = NULL;
+        set->old_size = 0;
+        set->rehash = 0;
         set->length = 0;
+        set->pool = NULL;
         return set;
 }
 
-BAOLIBDEF int bao_set_insert(bao_set_t set, void *member, void **prev)
+/*
+ * Creates a set whose members come from a private node pool, as with
+ * bao_map_create_pooled. Copies and unions of the set are pooled as well.
+ */
+BAOLIBDEF bao_set_t bao_set_create_pooled(size_t hint,
+                                          int (*compare)(const void *, const void *),
+                                          size_t (*hash)(const void *),
+                                          bao_arena_t arena)
 {
-        size_t i;
-        struct bao_member_t *p;
+        bao_set_t set;
 
-        assert(set);
-        assert(member);
+        set = bao_set_create(hint, compare, hash);
+        if (!set) {
+                return NULL;
+        }
 
-        i = set->hash(member) % set->size;
-        for (p = set->buckets[i]; p; p = p->next)
-                if (set->compare(member, p->member) == 0)
+        set->pool = bao_pool_create(sizeof(struct bao_member_t), 0, arena);
+        if (!set->pool) {
+                bao_set_free(&set);
+                return NULL;
+        }
+
+        return set;
+}
+
+/*
+ * Inserts member, whose hash is already known to be h.
+ */
+static int bao_set_insert_hashed(bao_set_t set, void *member, size_t h,
+                                 void **prev)
+{
+        struct bao_member_t **bucket, *p;
+
+        bao_set_rehash_step(set);
+        bucket = bao_set_bucket(set, h);
+        for (p = *bucket; p; p = p->next)
+                if (p->hash == h && set->compare(member, p->member) == 0)
                         break;
         if (p == NULL) {
-                p = BAO_MALLOC(sizeof(*p));
+                p = bao_set_node_alloc(set);
                 if (!p) {
                         BAO_LOG_MESSAGE("Ran out of memory!");
                         return -ENOMEM;
                 }
+                p->hash = h;
                 p->member = member;
-                p->next = set->buckets[i];
-                set->buckets[i] = p;
+                p->next = *bucket;
+                *bucket = p;
                 set->length++;
                 if (prev) *prev = NULL;
+                bao_set_resize(set);
         } else {
                 if (prev) *prev = p->member;
                 p->member = member;
@@ -829,17 +5992,24 @@ BAOLIBDEF int bao_set_insert(bao_set_t set, void *member, void **prev)
         return 0;
 }
 
+BAOLIBDEF int bao_set_insert(bao_set_t set, void *member, void **prev)
+{
+        assert(set);
+        assert(member);
+        return bao_set_insert_hashed(set, member, set->hash(member), prev);
+}
+
 BAOLIBDEF void *bao_set_inside(bao_set_t set, void *member)
 {
-        size_t i;
+        size_t h;
         struct bao_member_t *p;
 
         assert(set);
         assert(member);
 
-        i = set->hash(member) % set->size;
-        for (p = set->buckets[i]; p; p = p->next)
-                if (set->compare(member, p->member) == 0)
+        h = set->hash(member);
+        for (p = *bao_set_bucket(set, h); p; p = p->next)
+                if (p->hash == h && set->compare(member, p->member) == 0)
                         break;
         return p ? p->member : NULL;
 }
@@ -852,6 +6022,12 @@ BAOLIBDEF void bao_set_apply(bao_set_t set, void (*apply)(void *, void *),
         assert(set);
         assert(apply);
 
+        for (i = set->rehash; i < set->old_size; i++) {
+                for (p = set->old_buckets[i]; p; p = p->next) {
+                        apply(p->member, arg);
+                }
+        }
+
         for (i = 0; i < set->size; i++) {
                 for (p = set->buckets[i]; p; p = p->next) {
                         apply(p->member, arg);
@@ -859,37 +6035,166 @@ BAOLIBDEF void bao_set_apply(bao_set_t set, void (*apply)(void *, void *),
         }
 }
 
+#ifdef BAO_THREADS
+static void bao_set_apply_range(size_t lo, size_t hi, void *arg)
+{
+        struct bao_apply_parallel_t *p = arg;
+        bao_set_t set = p->container;
+        void *ctx = bao_apply_parallel_ctx(p);
+        size_t i, old = set->old_size - set->rehash;
+        struct bao_member_t *q;
+
+        for (i = lo; i < hi; i++) {
+                q = i < old ? set->old_buckets[set->rehash + i] : set->buckets[i - old];
+                for (; q; q = q->next) {
+                        p->apply(q->member, ctx);
+                }
+        }
+}
+
+/*
+ * Calls apply(member, ctx) on every member from the workers of pool,
+ * grain buckets per task. The set must not change until it returns.
+ *
+ * ctx and ctx_size work as for bao_map_apply_parallel: one shared ctx
+ * when ctx_size is 0, else one ctx_size slot per worker of pool.
+ */
+BAOLIBDEF int bao_set_apply_parallel(bao_set_t set, bao_threadpool_t pool,
+                                     size_t grain, void (*apply)(void *, void *),
+                                     void *ctx, size_t ctx_size)
+{
+        struct bao_apply_parallel_t p;
+        assert(set);
+        assert(pool);
+        assert(apply);
+
+        p.pool = pool;
+        p.container = set;
+        p.apply = apply;
+        p.ctx = ctx;
+        p.ctx_size = ctx_size;
+        return bao_threadpool_for(pool, 0, set->old_size - set->rehash + set->size,
+                                  grain, bao_set_apply_range, &p);
+}
+#endif /* BAO_THREADS */
+
+BAOLIBDEF void bao_set_iter_init(bao_set_t set, struct bao_set_iter_t *it)
+{
+        assert(set);
+        assert(it);
+        it->set = set;
+        it->bucket = 0;
+        it->link = NULL;
+        it->prev = NULL;
+}
+
+/*
+ * Moves to the next member and stores it. Returns 0 once the set is
+ * exhausted. The node after the returned one is prefetched.
+ */
+BAOLIBDEF int bao_set_iter_next(struct bao_set_iter_t *it, void **member)
+{
+        bao_set_t set;
+        struct bao_member_t *p;
+        size_t old;
+        assert(it);
+
+        set = it->set;
+        old = set->old_size - set->rehash;
+        while (!it->link || !*it->link) {
+                if (it->bucket >= old + set->size) {
+                        it->prev = NULL;
+                        return 0;
+                }
+                it->link = it->bucket < old ? &set->old_buckets[set->rehash + it->bucket]
+                        : &set->buckets[it->bucket - old];
+                it->bucket++;
+        }
+
+        p = *it->link;
+        if (p->next)
+                BAO_PREFETCH(p->next);
+        it->prev = it->link;
+        it->link = &p->next;
+        if (member) *member = p->member;
+        return 1;
+}
+
+/*
+ * Removes the member last returned by bao_set_iter_next without
+ * rehashing, so the cursor stays valid.
+ */
+BAOLIBDEF void bao_set_iter_remove(struct bao_set_iter_t *it)
+{
+        struct bao_member_t *p;
+        assert(it);
+        assert(it->prev && *it->prev);
+
+        p = *it->prev;
+        *it->prev = p->next;
+        it->link = it->prev;
+        it->prev = NULL;
+        bao_set_node_free(it->set, p);
+        it->set->length--;
+}
+
+static int bao_set_copy_chain(bao_set_t new_set, struct bao_member_t *p)
+{
+        size_t j;
+        struct bao_member_t *q;
+
+        for (; p; p = p->next) {
+                j = p->hash % new_set->size;
+                q = bao_set_node_alloc(new_set);
+                if (!q) {
+                        BAO_LOG_MESSAGE("Ran out of memory!");
+                        return -ENOMEM;
+                }
+                q->hash = p->hash;
+                q->member = p->member;
+                q->next = new_set->buckets[j];
+                new_set->buckets[j] = q;
+                new_set->length++;
+        }
+
+        return 0;
+}
+
 BAOLIBDEF bao_set_t bao_set_copy(bao_set_t set, size_t size)
 {
-        size_t i, j;
-        void *member;
+        size_t i;
         bao_set_t new_set;
-        struct bao_member_t *p, *q;
 
         assert(set);
-        new_set = bao_set_create(size, set->compare, set->hash);
+        if (set->pool) {
+                new_set = bao_set_create_pooled(BAO_MAX(size, set->length),
+                                                set->compare, set->hash,
+                                                set->pool->arena);
+        } else {
+                new_set = bao_set_create2(BAO_MAX(size, set->length),
+                                          set->compare, set->hash,
+                                          set->allocator);
+        }
         if (!new_set) {
                 BAO_LOG_MESSAGE("Ran out of memory!");
                 return NULL;
         }
 
+        for (i = set->rehash; i < set->old_size; i++) {
+                if (bao_set_copy_chain(new_set, set->old_buckets[i]) != 0) {
+                        bao_set_free(&new_set);
+                        return NULL;
+                }
+        }
+
         for (i = 0; i < set->size; i++) {
-                for (p = set->buckets[i]; p; p = p->next) {
-                        member = p->member;
-                        j = set->hash(member) % new_set->size;
-                        q = BAO_MALLOC(sizeof(*q));
-                        if (!q) {
-                                BAO_LOG_MESSAGE("Ran out of memory!");
-                                bao_set_free(&new_set);
-                                return NULL;
-                        }
-                        q->member = member;
-                        q->next = new_set->buckets[j];
-                        new_set->buckets[j] = q;
-                        new_set->length++;
+                if (bao_set_copy_chain(new_set, set->buckets[i]) != 0) {
+                        bao_set_free(&new_set);
+                        return NULL;
                 }
         }
 
+        bao_set_resize(new_set);
         return new_set;
 }
 
@@ -908,9 +6213,24 @@ BAOLIBDEF bao_set_t bao_set_union(bao_set_t set_a, bao_set_t set_b)
 
         assert(set_a->compare == set_b->compare && set_a->hash == set_b->hash);
         new_set = bao_set_copy(set_a, BAO_MAX(set_a->size, set_b->size));
+        if (!new_set) {
+                return NULL;
+        }
+
+        for (i = set_b->rehash; i < set_b->old_size; i++) {
+                for (p = set_b->old_buckets[i]; p; p = p->next) {
+                        if (bao_set_insert_hashed(new_set, p->member,
+                                                  p->hash, NULL) != 0) {
+                                bao_set_free(&new_set);
+                                return NULL;
+                        }
+                }
+        }
+
         for (i = 0; i < set_b->size; i++) {
                 for (p = set_b->buckets[i]; p; p = p->next) {
-                        if (bao_set_insert(new_set, p->member, NULL) != 0) {
+                        if (bao_set_insert_hashed(new_set, p->member,
+                                                  p->hash, NULL) != 0) {
                                 bao_set_free(&new_set);
                                 return NULL;
                         }
@@ -928,14 +6248,31 @@ BAOLIBDEF void bao_set_free(bao_set_t *set)
         assert(set);
         assert(*set);
 
-        for (i = 0; i < (*set)->size; i++) {
-                for (p = (*set)->buckets[i]; p; p = q) {
-                        q = p->next;
-                        BAO_FREE(p);
+        if ((*set)->pool) {
+                bao_pool_release(&(*set)->pool);
+        } else {
+                for (i = (*set)->rehash; i < (*set)->old_size; i++) {
+                        for (p = (*set)->old_buckets[i]; p; p = q) {
+                                q = p->next;
+                                bao_dealloc((*set)->allocator, p, sizeof(*p));
+                        }
+                }
+
+                for (i = 0; i < (*set)->size; i++) {
+                        for (p = (*set)->buckets[i]; p; p = q) {
+                                q = p->next;
+                                bao_dealloc((*set)->allocator, p, sizeof(*p));
+                        }
                 }
         }
 
-        BAO_FREE(*set);
+        if ((*set)->old_buckets) {
+                BAO_DEALLOC((*set)->allocator, (*set)->old_buckets,
+                            (*set)->old_size * sizeof(*(*set)->old_buckets));
+        }
+        BAO_DEALLOC((*set)->allocator, (*set)->buckets,
+                    (*set)->size * sizeof(*(*set)->buckets));
+        BAO_DEALLOC((*set)->allocator, *set, sizeof(**set));
 }
 
 static void bao_bvh_update_bounds(bao_bvh_t bvh, size_t index)
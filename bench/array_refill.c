@@ -0,0 +1,92 @@
+/*
+ * Refill throughput of a large bao_array_t: a zeroing array emptied with
+ * bao_array_clear against a raw one emptied with bao_array_reset, both
+ * for an array kept across rounds and for one created every round.
+ *
+ *	cc -O2 -I.. array_refill.c -o array_refill -lpthread
+ *	./array_refill [elements] [rounds]
+ */
+#define BAO_IMPLEMENTATION
+#include "../bao.h"
+
+#include <stdio.h>
+#include <time.h>
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static unsigned
+fill(bao_array_t array, size_t n, unsigned round)
+{
+	unsigned *data, sum = 0;
+	size_t i;
+
+	if (bao_array_resize(array, n) != 0)
+		exit(1);
+	data = array->data;
+	for (i = 0; i < n; i++)
+		data[i] = (unsigned) i ^ round;
+	for (i = 0; i < n; i += 4096)
+		sum += data[i];
+	return sum;
+}
+
+static void
+report(const char *name, double seconds, size_t n, int rounds, unsigned sum)
+{
+	printf("%-22s %8.2f ms/round %8.2f GB/s  (%u)\n", name,
+	       seconds * 1e3 / rounds,
+	       (double) n * sizeof(unsigned) * rounds / seconds / 1e9, sum);
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : (size_t) 1 << 23;
+	int r, rounds = argc > 2 ? atoi(argv[2]) : 20;
+	bao_array_t array;
+	unsigned sum;
+	double t;
+
+	array = bao_array_create(n, sizeof(unsigned));
+	fill(array, n, 0);
+	t = now();
+	for (sum = 0, r = 0; r < rounds; r++) {
+		bao_array_clear(array);
+		sum += fill(array, n, r);
+	}
+	report("kept, clear", now() - t, n, rounds, sum);
+	bao_array_free(&array);
+
+	array = bao_array_create_raw(n, sizeof(unsigned), NULL);
+	fill(array, n, 0);
+	t = now();
+	for (sum = 0, r = 0; r < rounds; r++) {
+		bao_array_reset(array);
+		sum += fill(array, n, r);
+	}
+	report("kept, reset (raw)", now() - t, n, rounds, sum);
+	bao_array_free(&array);
+
+	t = now();
+	for (sum = 0, r = 0; r < rounds; r++) {
+		array = bao_array_create(n, sizeof(unsigned));
+		sum += fill(array, n, r);
+		bao_array_free(&array);
+	}
+	report("fresh, create", now() - t, n, rounds, sum);
+
+	t = now();
+	for (sum = 0, r = 0; r < rounds; r++) {
+		array = bao_array_create_raw(n, sizeof(unsigned), NULL);
+		sum += fill(array, n, r);
+		bao_array_free(&array);
+	}
+	report("fresh, create_raw", now() - t, n, rounds, sum);
+	return 0;
+}
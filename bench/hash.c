@@ -0,0 +1,146 @@
+/*
+ * Hash quality and throughput: bao_hash_u64 and bao_hash_bytes against
+ * naive hashes (identity for integers, h * 31 + c for strings) as the
+ * hash of a prime-sized bao_map_t. For each key set it reports the chain
+ * lengths the map's buckets get and the time to insert and find every
+ * key, then the raw speed of bao_hash_bytes over a range of lengths.
+ *
+ *	cc -O2 -I.. hash.c -o hash -lpthread
+ *	./hash [keys]
+ */
+#define BAO_IMPLEMENTATION
+#include "../bao.h"
+
+#include <stdio.h>
+#include <time.h>
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static size_t
+naive_u64p(const void *key)
+{
+	return (size_t) *(const uint64_t *) key;
+}
+
+static size_t
+naive_str(const void *key)
+{
+	const unsigned char *s = key;
+	size_t h = 0;
+
+	while (*s)
+		h = h * 31 + *s++;
+	return h;
+}
+
+/*
+ * Prints the chain lengths of map: the longest chain, the share of empty
+ * buckets and the mean number of entries visited by a successful lookup.
+ */
+static void
+chains(bao_map_t map)
+{
+	struct bao_mapping_t *p;
+	size_t i, n, longest = 0, empty = 0, visits = 0;
+
+	if (map->old_buckets)
+		printf("  (mid-resize, new buckets only)");
+	for (i = 0; i < map->size; i++) {
+		for (n = 0, p = map->buckets[i]; p; p = p->next)
+			visits += ++n;
+		longest = BAO_MAX(longest, n);
+		empty += n == 0;
+	}
+	printf("  %8zu buckets  longest %4zu  empty %5.1f%%  visits %.3f\n",
+	       map->size, longest, 100.0 * empty / map->size,
+	       (double) visits / BAO_MAX(bao_map_length(map), 1));
+}
+
+static void
+run(const char *name, void **keys, size_t n,
+    int (*compare)(const void *, const void *), size_t (*hash)(const void *))
+{
+	bao_map_t map;
+	double insert, find;
+	size_t i, found = 0;
+
+	map = bao_map_create(n, compare, hash);
+	insert = now();
+	for (i = 0; i < n; i++)
+		bao_map_insert(map, keys[i], keys[i], NULL);
+	insert = now() - insert;
+
+	find = now();
+	for (i = 0; i < n; i++)
+		found += bao_map_find(map, keys[i]) != NULL;
+	find = now() - find;
+
+	printf("%-28s insert %6.1f ns  find %6.1f ns  (%zu)\n", name,
+	       insert * 1e9 / n, find * 1e9 / n, found);
+	chains(map);
+	bao_map_free(&map);
+}
+
+static void
+throughput(void)
+{
+	static const size_t lengths[] = { 8, 16, 32, 64, 256, 4096, 1 << 20 };
+	volatile uint64_t sink = 0;
+	char *buf;
+	size_t i, j, reps;
+	double t;
+
+	buf = malloc(1 << 20);
+	for (i = 0; i < 1 << 20; i++)
+		buf[i] = (char) (i * 131);
+	for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+		reps = ((size_t) 1 << 30) / lengths[i] / 4;
+		t = now();
+		for (j = 0; j < reps; j++)
+			sink += bao_hash_bytes(buf + (j & 7), lengths[i], sink);
+		t = now() - t;
+		printf("bao_hash_bytes %8zu bytes  %7.2f ns  %6.2f GB/s\n", lengths[i],
+		       t * 1e9 / reps, (double) lengths[i] * reps / t / 1e9);
+	}
+	free(buf);
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000, i;
+	uint64_t *ints = malloc(n * sizeof(*ints));
+	char (*strs)[24] = malloc(n * sizeof(*strs));
+	void **keys = malloc(n * sizeof(*keys));
+
+	for (i = 0; i < n; i++) {
+		ints[i] = i;
+		keys[i] = &ints[i];
+	}
+	run("sequential u64, bao", keys, n, bao_compare_u64p, bao_hash_u64p);
+	run("sequential u64, identity", keys, n, bao_compare_u64p, naive_u64p);
+
+	for (i = 0; i < n; i++)
+		ints[i] = (uint64_t) i * 8191 * 65536;
+	run("strided u64, bao", keys, n, bao_compare_u64p, bao_hash_u64p);
+	run("strided u64, identity", keys, n, bao_compare_u64p, naive_u64p);
+
+	for (i = 0; i < n; i++) {
+		snprintf(strs[i], sizeof(strs[i]), "user:%zu", i);
+		keys[i] = strs[i];
+	}
+	run("strings, bao", keys, n, bao_compare_str, bao_hash_str);
+	run("strings, h * 31 + c", keys, n, bao_compare_str, naive_str);
+
+	throughput();
+	free(keys);
+	free(strs);
+	free(ints);
+	return 0;
+}